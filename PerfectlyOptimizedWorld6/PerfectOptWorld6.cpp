@@ -6,14 +6,31 @@
 
 #include <algorithm>
 #include <cmath>
+#include <functional>
 #include <vector>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "MapEnums.h"
 #include "MapData.h"
 #include "ImageWriter.h"
 #include "Civ6MapWriter.h"
 
+#if defined(_M_X64) || defined(__x86_64__)
+#define PW6_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PW6_TARGET_AVX2
+#else
+#define PW6_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define PW6_X86 0
+#endif
+
 #pragma warning( disable : 6011 6387 26451 )
 
 // --- Data Types -------------------------------------------------------------
@@ -24,21 +41,153 @@ struct Coord
     uint16 y;
 };
 
-// lua floats are 64bit
-struct FloatMap
+// Coordinate offset from one hex to another
+struct HexOffset
+{
+    int16 x;
+    int16 y;
+};
+
+// One key per combination of row parity and the map edges a tile is on
+#define HEX_KEYS 32
+
+// Neighbor lookup tables for a map of a given size and wrap, built once by
+// InitHexTopology. Every tile stores a key for its row parity and the map
+// edges it touches, and each key holds the index delta to all 7 Dir
+// neighbors along with whether they fall off the map. Finding a neighbor is
+// then two table reads and no branches.
+struct HexTopology
+{
+    Dim dim;
+    bool wrapX : 1;
+    bool wrapY : 1;
+
+    uint8* keys;
+    int32 deltas[HEX_KEYS][7];  // by key, then Dir
+    uint32 offMap[HEX_KEYS][7]; // UINT32_MAX when off the map, 0 otherwise
+};
+
+// lua floats are 64bit, building with PW6_FLOAT32 defined stores the maps
+// in single precision instead. That halves the memory every map pass moves
+// at the cost of slightly different maps, see precisionReport in the settings
+#ifdef PW6_FLOAT32
+typedef float32 MapFloat;
+#else
+typedef float64 MapFloat;
+#endif
+
+template <typename T>
+struct FloatMapT
 {
     Dim dim;
     uint32 length;
     bool wrapX : 1;
     bool wrapY : 1;
 
-    float64* data = nullptr;
+    T* data = nullptr;
+};
+
+typedef FloatMapT<MapFloat> FloatMap;
+
+// Map storage with halo rows and columns around the edges so stencils can
+// read up to halo tiles off the map without any wrap logic. data points at
+// tile 0, 0 and rows are stride apart. RefreshHalo fills the halo from the
+// opposite edge when the map wraps and with zeros when it doesn't.
+template <typename T>
+struct PaddedMapT
+{
+    Dim dim;
+    uint16 halo;
+    uint32 stride;
+    bool wrapX : 1;
+    bool wrapY : 1;
+
+    T* storage = nullptr;
+    T* data = nullptr;
+};
+
+typedef PaddedMapT<MapFloat> PaddedMap;
+
+// Min and max of the values in a map. Loops that produce a map track it as
+// they write so that normalizing the map only takes a single pass
+struct Range
+{
+    float64 min;
+    float64 max;
+};
+
+// The area of the noise map sampled by a single perlin octave
+struct OctaveRect
+{
+    int32 x;
+    int32 y;
+    int32 width;
+    int32 height;
+    float64 freqX; // slight adjustment for seamless wrapping
+    float64 freqY; //        "                  "
+};
+
+#define MAX_PERLIN_OCTAVES 16
+// Most noise sources sampled together by GetPerlinNoiseRows
+#define MAX_PERLIN_CHANNELS 4
+
+// The lattice values perlin noise interpolates between. They either come
+// from a normalized FloatMap filled by rand(), which reproduces older seeds,
+// or from hashing the seed and lattice index on demand, which needs no
+// storage and doesn't depend on the order the values are read in.
+struct NoiseSource
+{
+    Dim dim;
+    bool wrapX : 1;
+    bool wrapY : 1;
+    // only 0 or 1 when hashed, like GenerateBinaryNoise
+    bool binary : 1;
+
+    FloatMap const* map; // nullptr when hashed
+    uint32 seed;
+
+    // Optional horizontal cubic coefficients of map, 4 per lattice cell,
+    // built by InitNoiseCoefficients
+    float64* coefs;
+};
+
+// Octave setup for sampling a noise source onto a destination map. It is
+// built once by InitPerlinPlan and only read while sampling, so a single
+// plan can be shared by any number of threads.
+struct PerlinPlan
+{
+    NoiseSource const* source;
+    uint8 octaves;
+    OctaveRect rects[MAX_PERLIN_OCTAVES];
+};
 
-    // TODO: check member size
-    int32 rectX;
-    int32 rectY;
-    int32 rectWidth;
-    int32 rectHeight;
+// Working buffers for sampling an entire row of perlin noise at once
+struct PerlinRowScratch
+{
+    uint32 capacity;
+
+    // 4 source columns per sample, stored tap major
+    uint32* cols;
+    float64* muX;
+    // taps gathered from a single source row, stored tap major
+    float64* taps;
+    // horizontally interpolated source rows, stored row major
+    float64* rows;
+    // x slopes of the same rows, for GetPerlinGradientRow
+    float64* slopes;
+    // octave sums before they are averaged into the output, one
+    // capacity sized block per channel
+    float64* sums;
+
+    // per sample state for batches that don't share a row
+    float64* muY;
+    float64* amp;
+    float64* sampleX;
+    float64* sampleY;
+    float64* sampleAmpChange;
+    // 4 source rows per sample, stored tap major
+    uint32* srcRows;
+    uint32* gatherIdx;
 };
 
 struct ElevationMap
@@ -125,12 +274,6 @@ struct LakeDataUtil
     uint32 currentLakeSize;
 };
 
-struct RefMap
-{
-    Coord c;
-    float64 val;
-};
-
 struct PangaeaBreaker
 {
     ElevationMap* map;
@@ -192,6 +335,32 @@ struct Thresholds
     // temp based in global settings
 };
 
+#define THRESHOLD_CACHE_SIZE 8
+
+// Thresholds last found on a map, see FindThresholdsFromPercents
+struct ThresholdCache
+{
+    uint64 hash;
+    uint32 length;
+    bool excludeZeros;
+
+    uint32 count;
+    float64 percents[THRESHOLD_CACHE_SIZE];
+    float64 values[THRESHOLD_CACHE_SIZE];
+};
+
+#define TILE_ORDER_CACHE_SIZE 4
+
+// Tile orderings already sorted, see GetTileOrder
+struct TileOrderCache
+{
+    std::mutex lock;
+    uint32 count;
+    uint64 hashes[TILE_ORDER_CACHE_SIZE];
+    uint32 lengths[TILE_ORDER_CACHE_SIZE];
+    uint32* tiles[TILE_ORDER_CACHE_SIZE];
+};
+
 // TODO: Considerations:
 //   Oasis exclusion flag
 
@@ -263,6 +432,45 @@ static const uint32 minimumMeteorSize = 2;
 // sqrt(.75) == 0.86602540378443864676372317075294
 static const float64 YtoXRatio = 1.5 / (0.86602540378443864676372317075294 * 2.0);
 
+// Step to each Dir neighbor for even and odd rows. Odd rows are shifted half
+// a hex to the east.
+static const HexOffset hexNeighborOffsets[2][dNum] =
+{
+    { { 0, 0 }, { -1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 0 }, { 0, -1 }, { -1, -1 } },
+    { { 0, 0 }, { -1, 0 }, {  0, 1 }, { 1, 1 }, { 1, 0 }, { 1, -1 }, {  0, -1 } },
+};
+
+// HexTopology key bits
+enum HexKeyBits
+{
+    hkOdd = 1 << 0,
+    hkWest = 1 << 1,  // x == 0
+    hkEast = 1 << 2,  // x == w - 1
+    hkSouth = 1 << 3, // y == 0
+    hkNorth = 1 << 4, // y == h - 1
+};
+
+// What a row of the map gets from its latitude
+struct LatitudeRow
+{
+    float64 latitude;
+    float64 pressure; // geostrophic, before it is normalized over the map
+    WindZone zone;
+    Dir wind;         // geostrophic wind of the zone
+    Dir lateralWind;
+};
+
+// Latitude, wind zone and geostrophic wind of every row, built once by
+// InitLatitudeModel. They only depend on the map height and the settings.
+struct LatitudeModel
+{
+    uint16 height;
+    LatitudeRow* rows;
+    // lowest and highest row of each WindZone, UINT16_MAX when not on the map
+    uint16 zoneBottom[wSPolar + 1];
+    uint16 zoneTop[wSPolar + 1];
+};
+
 
 
 // --- Static Globals ---------------------------------------------------------
@@ -270,14 +478,21 @@ static const float64 YtoXRatio = 1.5 / (0.86602540378443864676372317075294 * 2.0
 static PW6Settings gSet;
 // TODO: make thread local
 static Thresholds gThrs;
+static ThresholdCache gThrsCache;
+// Indexed by wrapX * 2 + wrapY, see GetHexTopology
+static HexTopology gHex[4];
+// Rows of the map being generated, see GetLatitudeModel
+static LatitudeModel gLat;
+// Offsets around a hex for each row parity, see InitHexStencils
+static HexOffset* gHexStencils[2];
+static uint32 gHexStencilRadius;
 // Create a 1 mb buffer
 static MapTile gMap[200000];
 
 
 // --- Forward Declarations ---------------------------------------------------
 
-uint32 GetRectIndex(FloatMap* map, int32 x, int32 y);
-bool IsOnMap(FloatMap* map, Coord c);
+bool IsOnMap(FloatMap const* map, Coord c);
 void InitPWArea(PWArea* area, uint32 ind, Coord c, bool trueMatch);
 void InitLineSeg(LineSeg* seg, int16 y, int16 xLeft, int16 xRight, int16 dy);
 void FillArea(PWAreaMap* map, Coord c, PWArea* area, MatchI mFunc);
@@ -300,11 +515,13 @@ void InitRiverJunction(RiverJunction* junc, Coord c, bool isNorth);
 float64 GetAttenuationFactor(Dim dim, Coord c);
 
 void GetNeighbor(FloatMap*, Coord coord, Dir dir, Coord* out);
-uint32 GetIndex(FloatMap* map, Coord coord);
+uint32 GetIndex(FloatMap const* map, Coord coord);
+HexTopology const* GetHexTopology(FloatMap const* map);
+uint32 GetNeighborIndex(HexTopology const* topo, uint32 i, Dir dir);
+void GetNeighborIndices(HexTopology const* topo, uint32 i, uint32 out[6]);
 bool IsBelowSeaLevel(ElevationMap* map, uint32 i);
 void FillArea(PWAreaMap* map, Coord c, PWArea* area, MatchI mFunc);
 void ScanAndFillLine(PWAreaMap* map, LineSeg seg, PWArea* area, MatchI mFunc);
-std::vector<uint32> GetRadiusAroundCell(Dim dim, Coord c, uint32 rad);
 uint32 GeneratePlotTypes(Dim dim, ElevationMap* outElev, FloatMap* outRain, FloatMap* outTemp, uint8** outPlot);
 uint32 GenerateTerrain(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap, uint8** out);
 void FinalAlterations(ElevationMap* map, uint8* plotTypes, uint8* terrainTypes);
@@ -318,8 +535,12 @@ void AddLakes(RiverMap* map);
 void AddRivers(RiverMap* map);
 void AddFeatures(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap);
 void ClearFloodPlains(RiverMap* map);
-void DistributeRain(Coord c, ElevationMap* map, FloatMap* temperatureMap,
-    FloatMap* pressureMap, FloatMap* rainfallMap, FloatMap* moistureMap, bool isGeostrophic);
+void DistributeRain(uint32 i, ElevationMap* map, FloatMap* temperatureMap,
+    FloatMap* pressureMap, FloatMap* upLiftMap, FloatMap* rainfallMap, FloatMap* moistureMap,
+    bool isGeostrophic);
+void SweepRain(ElevationMap* map, FloatMap* temperatureMap, FloatMap* pressureMap,
+    FloatMap* upLiftMap, uint32 const* visits, uint32 count, FloatMap* rainfallMap,
+    FloatMap* moistureMap, bool isGeostrophic, uint32 workers);
 float64 GetRainCost(float64 upLiftSource, float64 upLiftDest);
 void GetRiverSidesForJunction(RiverMap* map, RiverJunction* junc, MapTile** out0, MapTile** out1);
 bool IsPangea(PangaeaBreaker* pb);
@@ -334,7 +555,7 @@ void InitCentralityScore(CentralityScore* score, ElevationMap* map, Coord c);
 
 void PaintElevationMap(void* data, uint8 bgrOut[3])
 {
-    float64 val = *(float64*)data;
+    float64 val = *(MapFloat*)data;
 
     // ocean
     if (val <= gThrs.ocean)
@@ -385,7 +606,7 @@ void PaintElevationMap(void* data, uint8 bgrOut[3])
 
 void PaintUnitFloatGradient(void* data, uint8 bgrOut[3])
 {
-    float64 val = *(float64*)data;
+    float64 val = *(MapFloat*)data;
     assert(val >= 0.0 && val <= 3.0);
     //val /= 3;
 
@@ -546,7 +767,7 @@ void PaintMapTiles(void* data, uint8 bgrOut[3])
 
 void PaintIDS(void* data, uint8 bgrOut[3])
 {
-    float64 val = *(float64*)data;
+    float64 val = *(MapFloat*)data;
     val /= 500.0;
 
     bgrOut[0] = (uint8)(val * 0xFF);
@@ -795,11 +1016,12 @@ uint8 StampVertFlowDir(void* data)
 
 bool IsAdjacentToLand(ElevationMap* map, uint32 len, uint8* plotTypes, Coord c)
 {
-    for (uint32 dir = dW; dir < dNum; ++dir)
+    uint32 nbrs[6];
+    GetNeighborIndices(GetHexTopology(&map->base), GetIndex(&map->base, c), nbrs);
+
+    for (uint32 n = 0; n < 6; ++n)
     {
-        Coord n;
-        GetNeighbor(NULL, c, (Dir)dir, &n);
-        uint32 i = GetIndex(&map->base, n);
+        uint32 i = nbrs[n];
         if (i < map->base.length &&
             plotTypes[i] != ptOcean)
             return true;
@@ -930,6 +1152,7 @@ void LoadDefaultSettings(char const* settingsFile)
                 GetIntSetting(line,   "bottomLatitude", dataPos, &gSet.bottomLatitude);
                 break;
             case 'c': case 'C':
+                GetBoolSetting(line,  "cubicCoefficients", dataPos, &gSet.cubicCoefficients);
                 break;
             case 'd': case 'D':
                 GetFloatSetting(line, "desertPercent", dataPos, &gSet.desertPercent);
@@ -945,15 +1168,18 @@ void LoadDefaultSettings(char const* settingsFile)
             case 'g': case 'G':
                 GetFloatSetting(line, "geostrophicFactor", dataPos, &gSet.geostrophicFactor);
                 GetFloatSetting(line, "geostrophicLateralWindStrength", dataPos, &gSet.geostrophicLateralWindStrength);
+                GetBoolSetting(line,  "gradientReport", dataPos, &gSet.gradientReport);
                 break;
             case 'h': case 'H':
                 GetUIntSetting(line,  "height", dataPos, (uint32*)&gSet.height);
+                GetBoolSetting(line,  "hashedNoise", dataPos, &gSet.hashedNoise);
                 GetFloatSetting(line, "hillsPercent", dataPos, &gSet.hillsPercent);
                 GetIntSetting(line,   "horseLatitudes", dataPos, &gSet.horseLatitudes);
                 break;
             case 'i': case 'I':
                 GetIntSetting(line,   "iceNorthLatitudeLimit", dataPos, &gSet.iceNorthLatitudeLimit);
                 GetIntSetting(line,   "iceSouthLatitudeLimit", dataPos, &gSet.iceSouthLatitudeLimit);
+                GetBoolSetting(line,  "integerUpLift", dataPos, &gSet.integerUpLift);
                 break;
             case 'j': case 'J':
                 GetFloatSetting(line, "junglePercent", dataPos, &gSet.junglePercent);
@@ -978,6 +1204,7 @@ void LoadDefaultSettings(char const* settingsFile)
                 GetFloatSetting(line, "maxReefChance", dataPos, &gSet.maxReefChance);
                 GetFloatSetting(line, "minWaterTemp", dataPos, &gSet.minWaterTemp);
                 GetFloatSetting(line, "maxWaterTemp", dataPos, &gSet.maxWaterTemp);
+                GetBoolSetting(line,  "memoryReport", dataPos, &gSet.memoryReport);
                 break;
             case 'n': case 'N':
                 GetFloatSetting(line, "northAttenuationFactor", dataPos, &gSet.northAttenuationFactor);
@@ -996,6 +1223,8 @@ void LoadDefaultSettings(char const* settingsFile)
                 GetFloatSetting(line, "polarRainBoost", dataPos, &gSet.polarRainBoost);
                 GetFloatSetting(line, "percentRiversFloodplains", dataPos, &gSet.percentRiversFloodplains);
                 GetBoolSetting(line,  "proportionalMinors", dataPos, &gSet.proportionalMinors);
+                GetBoolSetting(line,  "precisionReport", dataPos, &gSet.precisionReport);
+                GetBoolSetting(line,  "parallelRain", dataPos, &gSet.parallelRain);
                 break;
             case 'q': case 'Q':
                 break;
@@ -1003,12 +1232,16 @@ void LoadDefaultSettings(char const* settingsFile)
                 GetFloatSetting(line, "riverPercent", dataPos, &gSet.riverPercent);
                 GetUIntSetting(line,  "resources", dataPos, (uint32*)&gSet.resources);
                 GetIntSetting(line,   "realEstateMin", dataPos, &gSet.realEstateMin);
+                GetBoolSetting(line,  "radixRainSort", dataPos, &gSet.radixRainSort);
                 break;
             case 's': case 'S':
                 GetFloatSetting(line, "southAttenuationFactor", dataPos, &gSet.southAttenuationFactor);
                 GetFloatSetting(line, "southAttenuationRange", dataPos, &gSet.southAttenuationRange);
                 GetFloatSetting(line, "snowTemperature", dataPos, &gSet.snowTemperature);
                 GetUIntSetting(line,  "start", dataPos, (uint32*)&gSet.start);
+                GetUIntSetting(line,  "simdLevel", dataPos, (uint32*)&gSet.simdLevel);
+                GetBoolSetting(line,  "signedEdgeWrap", dataPos, &gSet.signedEdgeWrap);
+                GetBoolSetting(line,  "slidingHexSums", dataPos, &gSet.slidingHexSums);
                 break;
             case 't': case 'T':
                 GetIntSetting(line,   "topLatitude", dataPos, &gSet.topLatitude);
@@ -1030,6 +1263,7 @@ void LoadDefaultSettings(char const* settingsFile)
                 GetBoolSetting(line,  "wrapY", dataPos, &gSet.wrapY);
                 GetFloatSetting(line, "westAttenuationFactor", dataPos, &gSet.westAttenuationFactor);
                 GetFloatSetting(line, "westAttenuationRange", dataPos, &gSet.westAttenuationRange);
+                GetUIntSetting(line,  "workerThreads", dataPos, &gSet.workerThreads);
                 break;
             case 'x': case 'X':
                 break;
@@ -1101,472 +1335,2325 @@ static int32 PWRandInt(int32 min, int32 max)
 }
 
 
-// --- Interpolation and Perlin Functions
+// --- Threading
 
-inline float64 CubicInterpolate(float64 r[4], float64 mu)
+struct WorkerJob
 {
-    float64 mu2 = mu * mu;
-    float64 a0 = (r[3] - r[2]) - (r[0] - r[1]);
-    float64 a1 = (r[0] - r[1]) - a0;
-    float64 a2 =  r[2] - r[0];
-    float64 a3 =  r[1];
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32 pending;
+};
 
-    return a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
-}
+struct WorkerTask
+{
+    void (*run)(void* ctx, uint32 part);
+    void* ctx;
+    uint32 part;
+    WorkerJob* job;
+};
 
-// TODO: see if this can be composited row by row for the entire map (+ transposition?)
-float64 BicubicInterpolate(float64 r0[16], float64 muX, float64 muY)
+// Threads the parallel steps hand their work to. They're started by the
+// first generation and kept until the program exits, or until a generation
+// asks for a different number of them.
+struct WorkerPool
 {
-    float64 a[4];
-    a[0] = CubicInterpolate(r0, muX);
-    a[1] = CubicInterpolate(r0 + 4, muX);
-    a[2] = CubicInterpolate(r0 + 8, muX);
-    a[3] = CubicInterpolate(r0 + 12, muX);
+    std::vector<std::thread> threads;
+    // queued tasks start at next
+    std::vector<WorkerTask> tasks;
+    uint32 next = 0;
+    bool quit = false;
 
-    return CubicInterpolate(a, muY);
-}
+    std::mutex lock;
+    std::condition_variable cv;
+};
 
-inline float64 CubicDerivative(float64 r[4], float64 mu)
-{
-    float64 mu2 = mu * mu;
-    float64 a0 = (r[3] - r[2]) - (r[0] - r[1]);
-    float64 a1 = (r[0] - r[1]) - a0;
-    float64 a2 =  r[2] - r[0];
-    //float64 a3 =  r[1];
+static WorkerPool gWorkers;
 
-    return 3 * a0 * mu2 + 2 * a1 * mu + a2;
-}
+// Most workers the parallel steps on this thread may use, 0 for no limit
+static thread_local uint32 tWorkerBudget = 0;
+// Set while running a part of a parallel step, which keeps anything it
+// calls serial so the pool can't run out of threads
+static thread_local bool tInParallel = false;
 
-// TODO: see if this can be composited row by row for the entire map (+ transposition?)
-float64 BicubicDerivative(float64 r0[16], float64 muX, float64 muY)
+// Number of threads work gets split across, including the calling thread
+static uint32 GetWorkerCount()
 {
-    float64 a[4];
-    a[0] = CubicInterpolate(r0, muX);
-    a[1] = CubicInterpolate(r0 + 4, muX);
-    a[2] = CubicInterpolate(r0 + 8, muX);
-    a[3] = CubicInterpolate(r0 + 12, muX);
+    if (tInParallel)
+        return 1;
+
+    uint32 count = (uint32)gWorkers.threads.size() + 1;
+    if (tWorkerBudget)
+        count = std::min(count, tWorkerBudget);
 
-    return CubicDerivative(a, muY);
+    return count;
 }
 
-// This function gets a smoothly interpolated value from srcMap.
-// xand y are non - integer coordinates of where the value is to
-// be calculated, and wrap in both directions.srcMap is an object
-// of type FloatMap.
-float64 GetInterpolatedValue(float64 x, float64 y, FloatMap* srcMap)
+static void RunWorker()
 {
-    float64 points[16];
-    int32 fX = floor(x);
-    int32 fY = floor(y);
-    float64 fractionX = x - fX;
-    float64 fractionY = y - fY;
+    tInParallel = true;
+    std::unique_lock<std::mutex> lock(gWorkers.lock);
 
-    // wrappedX and wrappedY are set to -1,-1 of the sampled area
-    // so that the sample area is in the middle quad of the 4x4 grid
-    int32 wrappedX = ((fX - 1) % srcMap->rectWidth) + srcMap->rectX;
-    int32 wrappedY = ((fY - 1) % srcMap->rectHeight) + srcMap->rectY;
-
-    for (uint16 pY = 0; pY < 4; ++pY)
+    for (;;)
     {
-        int32 cY = pY + wrappedY;
-        for (uint16 pX = 0; pX < 4; ++pX)
+        gWorkers.cv.wait(lock, [] { return gWorkers.quit || gWorkers.next < gWorkers.tasks.size(); });
+        if (gWorkers.next == gWorkers.tasks.size())
+            return;
+
+        WorkerTask task = gWorkers.tasks[gWorkers.next++];
+        if (gWorkers.next == gWorkers.tasks.size())
         {
-            int32 cX = pX + wrappedX;
-            uint32 srcIndex = GetRectIndex(srcMap, cX, cY);
-            points[(pY * 4 + pX)] = srcMap->data[srcIndex];
+            gWorkers.tasks.clear();
+            gWorkers.next = 0;
         }
-    }
+        lock.unlock();
 
-    float64 finalValue = BicubicInterpolate(points, fractionX, fractionY);
+        task.run(task.ctx, task.part);
+        {
+            std::lock_guard<std::mutex> jobLock(task.job->lock);
+            if (--task.job->pending == 0)
+                task.job->cv.notify_one();
+        }
 
-    return finalValue;
+        lock.lock();
+    }
 }
 
-float64 GetDerivativeValue(float64 x, float64 y, FloatMap* srcMap)
+void ExitWorkerPool()
 {
-    float64 points[16];
-    int32 fX = floor(x);
-    int32 fY = floor(y);
-    float64 fractionX = x - fX;
-    float64 fractionY = y - fY;
+    {
+        std::lock_guard<std::mutex> lock(gWorkers.lock);
+        gWorkers.quit = true;
+    }
+    gWorkers.cv.notify_all();
 
-    // wrappedX and wrappedY are set to -1,-1 of the sampled area
-    // so that the sample area is in the middle quad of the 4x4 grid
-    int32 wrappedX = ((fX - 1) % srcMap->rectWidth) + srcMap->rectX;
-    int32 wrappedY = ((fY - 1) % srcMap->rectHeight) + srcMap->rectY;
+    for (std::thread& thread : gWorkers.threads)
+        thread.join();
+    gWorkers.threads.clear();
+    gWorkers.quit = false;
+}
 
-    for (uint16 pY = 0; pY < 4; ++pY)
+// Starts one thread less than workerThreads asks for, the calling thread
+// being the last worker. Does nothing if they're already running
+void InitWorkerPool()
+{
+    static bool registered = false;
+    if (!registered)
     {
-        int32 cY = pY + wrappedY;
-        for (uint16 pX = 0; pX < 4; ++pX)
-        {
-            int32 cX = pX + wrappedX;
-            uint32 srcIndex = GetRectIndex(srcMap, cX, cY);
-            points[(pY * 4 + pX)] = srcMap->data[srcIndex];
-        }
+        atexit(ExitWorkerPool);
+        registered = true;
     }
 
-    float64 finalValue = BicubicDerivative(points, fractionX, fractionY);
+    uint32 count = gSet.workerThreads;
+    if (count == 0)
+        count = std::thread::hardware_concurrency();
+    count = std::max(count, 1u) - 1;
+
+    if (gWorkers.threads.size() == count)
+        return;
 
-    return finalValue;
+    ExitWorkerPool();
+    for (uint32 i = 0; i < count; ++i)
+        gWorkers.threads.emplace_back(RunWorker);
 }
 
-// This function gets Perlin noise for the destination coordinates.Note
-// that in order for the noise to wrap, the area sampled on the noise map
-// must change to fit each octave.
-float64 GetPerlinNoise(float64 x, float64 y, uint16 destMapWidth, float64 destMapHeight, 
-    float64 initialFrequency, float64 initialAmplitude, float64 amplitudeChange, 
-    uint8 octaves, FloatMap* noiseMap)
+// Calls fn(part) for every part in [0, parts) at the same time, part 0 on
+// the calling thread and the rest on the pool, and returns once all of them
+// are done. The parts may wait on each other, since the worker budgets of
+// steps running side by side never add up to more threads than the pool has
+template <typename Fn>
+void RunOnWorkers(uint32 parts, Fn& fn)
 {
-    assert(octaves > 0);
-    assert(noiseMap);
+    assert(parts <= gWorkers.threads.size() + 1);
 
-    float64 finalValue = 0.0;
-    float64 freq = initialFrequency;
-    float64 amp = initialAmplitude;
-    float64 freqX; // slight adjustment for seamless wrapping
-    float64 freqY; //        "                  "
+    WorkerJob job;
+    job.pending = parts - 1;
+    auto run = [](void* ctx, uint32 part) { (*(Fn*)ctx)(part); };
 
-    for (int i = 0; i < octaves; ++i)
     {
-        // TODO: clean up branching
-        if (noiseMap->wrapX)
-        {
-            int32 rX = (int32)floor(noiseMap->dim.w / 2.0 - (destMapWidth * freq) / 2.0);
-            assert(rX >= 0 - 0x7FFF && rX <= 0x7FFF);
-            noiseMap->rectX = rX;
-            int32 rW = std::max((int32)floor(destMapWidth * freq), 1);
-            assert(rW >= 0 && rW <= 0xFFFF);
-            noiseMap->rectWidth = rW;
-            freqX = noiseMap->rectWidth / (float64)destMapWidth;
-        }
-        else
-        {
-            noiseMap->rectX = 0;
-            noiseMap->rectWidth = noiseMap->dim.w;
-            freqX = freq;
-        }
+        std::lock_guard<std::mutex> lock(gWorkers.lock);
+        for (uint32 i = 1; i < parts; ++i)
+            gWorkers.tasks.push_back({ run, &fn, i, &job });
+    }
+    gWorkers.cv.notify_all();
 
-        if (noiseMap->wrapY)
-        {
-            int32 rY = (int32)floor(noiseMap->dim.h / 2.0 - (destMapHeight * freq) / 2.0);
-            assert(rY >= 0 - 0x7FFF && rY <= 0x7FFF);
-            noiseMap->rectY = rY;
-            int32 rH = std::max((int32)floor(destMapHeight * freq), 1);
-            assert(rH >= 0 && rH <= 0xFFFF);
-            noiseMap->rectHeight = rH;
-            freqY = noiseMap->rectHeight / (float64)destMapHeight;
-        }
-        else
-        {
-            noiseMap->rectY = 0;
-            noiseMap->rectHeight = noiseMap->dim.h;
-            freqY = freq;
-        }
+    bool inParallel = tInParallel;
+    tInParallel = true;
+    fn(0u);
+    tInParallel = inParallel;
 
-        finalValue += GetInterpolatedValue(x * freqX, y * freqY, noiseMap) * amp;
-        freq *= 2.0;
-        amp *= amplitudeChange;
+    std::unique_lock<std::mutex> lock(job.lock);
+    job.cv.wait(lock, [&] { return job.pending == 0; });
+}
+
+// Limits the workers of the parallel steps run from this thread, so steps
+// running side by side can share them. Returns the previous budget
+static uint32 SetWorkerBudget(uint32 budget)
+{
+    uint32 previous = tWorkerBudget;
+    tWorkerBudget = budget;
+    return previous;
+}
+
+// Splits [0, count) into one contiguous chunk per worker and calls
+// fn(begin, end) for each of them, the first chunk on the calling thread.
+// Chunks only depend on count and the worker count, and fn is expected to
+// only write to its own chunk, so the results match a serial loop.
+template <typename Fn>
+void ParallelFor(uint32 count, Fn fn)
+{
+    uint32 workers = std::min(GetWorkerCount(), count);
+    if (workers <= 1)
+    {
+        fn(0u, count);
+        return;
     }
 
-    return finalValue / octaves;
+    auto chunk = [&](uint32 i)
+    {
+        fn((uint32)((uint64)count * i / workers), (uint32)((uint64)count * (i + 1) / workers));
+    };
+    RunOnWorkers(workers, chunk);
 }
 
-float64 GetPerlinDerivative(float64 x, float64 y, uint16 destMapWidth, float64 destMapHeight,
-    float64 initialFrequency, float64 initialAmplitude, float64 amplitudeChange,
-    uint8 octaves, FloatMap* noiseMap)
+// Lets a fixed set of threads step through phases together
+struct Barrier
 {
-    assert(octaves > 0);
-    assert(noiseMap);
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32 count;
+    uint32 waiting;
+    uint32 generation;
+};
 
-    float64 finalValue = 0.0;
-    float64 freq = initialFrequency;
-    float64 amp = initialAmplitude;
-    float64 freqX; // slight adjustment for seamless wrapping
-    float64 freqY; //        "                  "
+void InitBarrier(Barrier* barrier, uint32 count)
+{
+    barrier->count = count;
+    barrier->waiting = 0;
+    barrier->generation = 0;
+}
+
+// Blocks until all count threads have arrived
+void WaitBarrier(Barrier* barrier)
+{
+    std::unique_lock<std::mutex> lock(barrier->lock);
+    uint32 generation = barrier->generation;
 
-    for (int i = 0; i < octaves; ++i)
+    if (++barrier->waiting == barrier->count)
     {
-        // TODO: clean up branching
-        if (noiseMap->wrapX)
-        {
-            int32 rX = (int32)floor(noiseMap->dim.w / 2.0 - (destMapWidth * freq) / 2.0);
-            assert(rX >= 0 - 0x7FFF && rX <= 0x7FFF);
-            noiseMap->rectX = rX;
-            int32 rW = (int32)floor(destMapWidth * freq);
-            assert(rW >= 0 && rW <= 0xFFFF);
-            noiseMap->rectWidth = rW;
-            freqX = noiseMap->rectWidth / destMapWidth;
-        }
-        else
-        {
-            noiseMap->rectX = 0;
-            noiseMap->rectWidth = noiseMap->dim.w;
-            freqX = freq;
-        }
+        barrier->waiting = 0;
+        ++barrier->generation;
+        barrier->cv.notify_all();
+        return;
+    }
 
-        if (noiseMap->wrapY)
-        {
-            int32 rY = (int32)floor(noiseMap->dim.h / 2.0 - (destMapHeight * freq) / 2.0);
-            assert(rY >= 0 - 0x7FFF && rY <= 0x7FFF);
-            noiseMap->rectY = rY;
-            int32 rH = (int32)floor(destMapHeight * freq);
-            assert(rH >= 0 && rH <= 0xFFFF);
-            noiseMap->rectHeight = rH;
-            freqY = noiseMap->rectHeight / destMapHeight;
-        }
-        else
-        {
-            noiseMap->rectY = 0;
-            noiseMap->rectHeight = noiseMap->dim.h;
-            freqY = freq;
-        }
+    barrier->cv.wait(lock, [&] { return generation != barrier->generation; });
+}
 
-        finalValue += GetDerivativeValue(x * freqX, y * freqY, noiseMap) * amp;
-        freq *= 2.0;
-        amp *= amplitudeChange;
-    }
+static std::mutex gImageMutex;
 
-    return finalValue / octaves;
+// The image writer has a single shared canvas, so saves from concurrent
+// generation steps have to take turns
+void SaveFloatMap(FloatMap* map, char const* filename)
+{
+    std::lock_guard<std::mutex> lock(gImageMutex);
+    DrawHexes(map->data, sizeof *map->data, PaintUnitFloatGradient);
+    SaveMap(filename);
 }
 
 
+// --- Generation Pool
 
-// --- Member Functions -------------------------------------------------------------
+// Scratch and map buffers come from a pool that lives across attempts and
+// generations. Freed blocks are kept for the next request they fit, so once
+// warmed up a generation no longer goes to the system allocator for them.
+struct PoolBlock
+{
+    size_t size;
+    // bytes asked for by the current owner, at most size
+    size_t requested;
+    // order the current owner got it in, see GetPoolMark
+    uint32 serial;
+    bool inUse;
+};
 
-// --- MapTile
+// keeps the data after each header aligned for any type
+#define POOL_HEADER_SIZE 32
+STATIC_ASSERT(sizeof(PoolBlock) <= POOL_HEADER_SIZE);
 
-inline bool IsWater(MapTile* tile)
+// free blocks are binned by the highest set bit of their size
+#define POOL_CLASSES 64
+
+struct GenPool
 {
-    return tile->terrain < tWaterEnd;
-}
+    std::vector<PoolBlock*> blocks;
+    std::vector<PoolBlock*> freeBlocks[POOL_CLASSES];
+    // requested bytes, a reused block may be up to twice as large
+    size_t inUse = 0;
+    size_t peak = 0;
+    size_t reserved = 0;
+    // blocks that had to come from the system since the last reset
+    uint32 newBlocks = 0;
+    uint32 serial = 0;
 
-// --- FloatMap
+    std::mutex lock;
+};
 
-void InitFloatMap(FloatMap * map, Dim dim, bool wrapX, bool wrapY)
+static GenPool gPool;
+
+inline uint32 GetPoolClass(size_t size)
 {
-    assert(map);
-    assert(!map->data);
+    uint32 c = 0;
+    while (size >>= 1)
+        ++c;
+    return c;
+}
 
-    map->dim = dim;
-    map->length = dim.w * dim.h;
-    map->wrapX = wrapX;
-    map->wrapY = wrapY;
+// Takes the smallest block of bin c that fits between size and limit out of
+// the bin, or returns null
+static PoolBlock* TakeFreeBlock(uint32 c, size_t size, size_t limit)
+{
+    std::vector<PoolBlock*>& bin = gPool.freeBlocks[c];
+    uint32 best = UINT32_MAX;
+    for (uint32 i = 0; i < bin.size(); ++i)
+        if (bin[i]->size >= size && bin[i]->size <= limit &&
+            (best == UINT32_MAX || bin[i]->size < bin[best]->size))
+            best = i;
 
-    map->data = (float64*)calloc(map->length, sizeof(*map->data));
+    if (best == UINT32_MAX)
+        return nullptr;
 
-    // TODO: check member size
-    map->rectX = 0;
-    map->rectY = 0;
-    map->rectWidth = dim.w;
-    map->rectHeight = dim.h;
+    PoolBlock* block = bin[best];
+    bin[best] = bin.back();
+    bin.pop_back();
+    return block;
 }
 
-void ExitFloatMap(FloatMap* map)
+static void ReleaseBlock(PoolBlock* block)
 {
-    free(map->data);
+    block->inUse = false;
+    gPool.inUse -= block->requested;
+    gPool.freeBlocks[GetPoolClass(block->size)].push_back(block);
 }
 
-void GetNeighbor(FloatMap *, Coord coord, Dir dir, Coord * out)
+// Reused blocks still hold whatever their last owner left in them. Anything
+// that reads entries before writing them has to use PoolCalloc instead.
+void* PoolAlloc(size_t size)
 {
-    // TODO: precalculate offsets on map generation so there is no branching
-    uint16 odd = coord.y % 2;
+    std::lock_guard<std::mutex> lock(gPool.lock);
 
-    switch (dir)
+    // smallest free block that fits without wasting more than half of it.
+    // Blocks in size's own bin are all smaller than the ones in the next,
+    // and anything past that is more than twice as large
+    uint32 c = GetPoolClass(size);
+    PoolBlock* best = TakeFreeBlock(c, size, size * 2);
+    if (!best && c + 1 < POOL_CLASSES)
+        best = TakeFreeBlock(c + 1, size, size * 2);
+
+    if (!best)
     {
-    case dC:
-        out->x = coord.x;
-        out->y = coord.y;
-        break;
-    case dW:
-        out->x = coord.x - 1;
-        out->y = coord.y;
-        break;
-    case dNW:
-        out->x = coord.x - 1 + odd;
-        out->y = coord.y + 1;
-        break;
-    case dNE:
-        out->x = coord.x + odd;
-        out->y = coord.y + 1;
-        break;
-    case dE:
-        out->x = coord.x + 1;
-        out->y = coord.y;
-        break;
-    case dSE:
-        out->x = coord.x + odd;
-        out->y = coord.y - 1;
-        break;
-    case dSW:
-        out->x = coord.x - 1 + odd;
-        out->y = coord.y - 1;
-        break;
-    default:
-        assert(0);
-        break;
+        best = (PoolBlock*)malloc(POOL_HEADER_SIZE + size);
+        if (!best)
+        {
+            printf("ERROR - Out of memory allocating %zu bytes for the generation pool.\n", size);
+            abort();
+        }
+        best->size = size;
+        gPool.blocks.push_back(best);
+        gPool.reserved += size;
+        ++gPool.newBlocks;
     }
+
+    best->inUse = true;
+    best->requested = size;
+    best->serial = gPool.serial++;
+    gPool.inUse += size;
+    gPool.peak = std::max(gPool.peak, gPool.inUse);
+
+    return (uint8*)best + POOL_HEADER_SIZE;
 }
 
-uint32 GetIndex(FloatMap* map, Coord coord)
+void* PoolCalloc(size_t count, size_t size)
 {
-    uint32 x = 0, y = 0;
-
-    // TODO: remove branching
-    if (map->wrapX)
-        x = coord.x % map->dim.w;
-    else if (coord.x > map->dim.w - 1)
-        return UINT32_MAX;// TODO: assert(0);
-    else
-        x = coord.x;
+    void* data = PoolAlloc(count * size);
+    memset(data, 0, count * size);
+    return data;
+}
 
-    if (map->wrapY)
-        y = coord.y % map->dim.h;
-    else if (coord.y > map->dim.h - 1)
-        return UINT32_MAX;// TODO: assert(0);
-    else
-        y = coord.y;
+void PoolFree(void* data)
+{
+    if (!data)
+        return;
 
-    return y * map->dim.w + x;
+    std::lock_guard<std::mutex> lock(gPool.lock);
+    PoolBlock* block = (PoolBlock*)((uint8*)data - POOL_HEADER_SIZE);
+    assert(block->inUse);
+    ReleaseBlock(block);
 }
 
-// TODO: Don't use
-Coord GetXYFromIndex(FloatMap* map, uint32 ind)
+// Everything allocated after GetPoolMark can be taken back at once with
+// RewindGenPool, without touching the blocks allocated before it
+uint32 GetPoolMark()
 {
-    return { (uint16)(ind % map->dim.w), (uint16)(ind / map->dim.w) };
+    std::lock_guard<std::mutex> lock(gPool.lock);
+    return gPool.serial;
 }
 
-// quadrants are labeled
-// A B
-// D C
-Quadrant GetQuadrant(FloatMap* map, Coord coord)
+// Takes back every block allocated since mark that is still in use, such as
+// the ones held by maps of a failed attempt that were never exited
+void RewindGenPool(uint32 mark)
 {
-    // TODO: convert to pure math
-    if (coord.x < map->dim.w / 2)
-    {
-        if (coord.y < map->dim.h / 2)
-            return qA;
-        else
-            return qD;
-    }
-    else
-    {
-        if (coord.y < map->dim.h / 2)
-            return qB;
-        else
-            return qC;
-    }
+    std::lock_guard<std::mutex> lock(gPool.lock);
+    for (PoolBlock* block : gPool.blocks)
+        if (block->inUse && block->serial >= mark)
+            ReleaseBlock(block);
 }
 
-// Gets an index for x and y based on the current
-// rect settings. x and y are local to the defined rect.
-// Wrapping is assumed in both directions
-uint32 GetRectIndex(FloatMap* map, int32 x, int32 y)
+// Measures the most a single step of the generation has requested at once
+struct PoolScope
 {
-    int32 mX = map->rectX + (x % map->rectWidth);
-    int32 mY = map->rectY + (y % map->rectHeight);
-    mX %= map->dim.w;
-    mY %= map->dim.h;
-    if (mX < 0)
-        mX += map->dim.w;
-    if (mY < 0)
-        mY += map->dim.h;
+    size_t base;
+    size_t outerPeak;
+};
 
-    return GetIndex(map, { (uint16)mX, (uint16)mY });
+void BeginPoolScope(PoolScope* scope)
+{
+    std::lock_guard<std::mutex> lock(gPool.lock);
+    scope->base = gPool.inUse;
+    scope->outerPeak = gPool.peak;
+    gPool.peak = gPool.inUse;
 }
 
-void Normalize(FloatMap* map)
+// Returns the peak requested since BeginPoolScope beyond what was in use then
+size_t EndPoolScope(PoolScope* scope)
 {
-    float64 maxAlt = *map->data;
-    float64 minAlt = *map->data;
+    std::lock_guard<std::mutex> lock(gPool.lock);
+    size_t peak = gPool.peak - scope->base;
+    gPool.peak = std::max(gPool.peak, scope->outerPeak);
+    return peak;
+}
 
-    float64* it = map->data + 1;
-    float64* end = map->data + map->length;
-    for (; it < end; ++it)
-    {
-        if (*it < minAlt)
-            minAlt = *it;
-        else if (*it > maxAlt)
-            maxAlt = *it;
-    }
+// Takes back every block at the end of a generation, including the ones
+// still held by maps that were never exited
+void ResetGenPool()
+{
+    printf("Generation pool: %zu KB peak, %zu KB reserved, %u new blocks\n",
+        gPool.peak / 1024, gPool.reserved / 1024, gPool.newBlocks);
 
-    // subtract minAlt from all values so that
-    // all values are zero and above
-    for (it = map->data; it < end; ++it)
-        *it -= minAlt;
+    for (PoolBlock* block : gPool.blocks)
+        if (block->inUse)
+            ReleaseBlock(block);
 
-    // subract minAlt also from maxAlt
-    maxAlt -= minAlt;
+    assert(gPool.inUse == 0);
+    gPool.peak = 0;
+    gPool.newBlocks = 0;
+    gPool.serial = 0;
+}
 
-    float64 normVal = maxAlt <= 0 ? 0.0 : 1.0 / maxAlt;
 
-    for (it = map->data; it < end; ++it)
-        *it *= normVal;
+// --- Interpolation and Perlin Functions
+
+inline float64 CubicInterpolate(float64 r[4], float64 mu)
+{
+    float64 mu2 = mu * mu;
+    float64 a0 = (r[3] - r[2]) - (r[0] - r[1]);
+    float64 a1 = (r[0] - r[1]) - a0;
+    float64 a2 =  r[2] - r[0];
+    float64 a3 =  r[1];
+
+    return a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
+}
+
+inline float64 CubicDerivative(float64 r[4], float64 mu)
+{
+    float64 mu2 = mu * mu;
+    float64 a0 = (r[3] - r[2]) - (r[0] - r[1]);
+    float64 a1 = (r[0] - r[1]) - a0;
+    float64 a2 =  r[2] - r[0];
+
+    return 3 * a0 * mu2 + 2 * a1 * mu + a2;
+}
+
+// --- Noise Sources
+
+void InitMapNoiseSource(NoiseSource* source, FloatMap const* map)
+{
+    source->dim = map->dim;
+    source->wrapX = map->wrapX;
+    source->wrapY = map->wrapY;
+    source->binary = false;
+    source->map = map;
+    source->seed = 0;
+    source->coefs = nullptr;
+}
+
+void InitHashedNoiseSource(NoiseSource* source, Dim dim, bool wrapX, bool wrapY,
+    bool binary, uint32 seed)
+{
+    source->dim = dim;
+    source->wrapX = wrapX;
+    source->wrapY = wrapY;
+    source->binary = binary;
+    source->map = nullptr;
+    source->seed = seed;
+    source->coefs = nullptr;
+}
+
+// Precomputes the a0 - a3 terms of CubicInterpolate for every cell of the
+// source map, using the cell and its x - 1, x + 1 and x + 2 neighbors. The
+// samplers then only evaluate the polynomial for taps that don't straddle
+// an octave's rect seam. Uses 4 float64 per cell.
+void InitNoiseCoefficients(NoiseSource* source)
+{
+    assert(source->map && !source->coefs);
+
+    uint32 w = source->dim.w;
+    uint32 h = source->dim.h;
+    uint32 size = w * h * 4 * sizeof(float64);
+    source->coefs = (float64*)PoolAlloc(size);
+    printf("Cubic coefficients: %u KB\n", size / 1024);
+
+    MapFloat const* data = source->map->data;
+    float64* ins = source->coefs;
+    for (uint32 y = 0; y < h; ++y)
+    {
+        MapFloat const* row = data + y * w;
+        for (uint32 x = 0; x < w; ++x, ins += 4)
+        {
+            float64 r[4];
+            for (uint32 p = 0; p < 4; ++p)
+                r[p] = row[(x + w - 1 + p) % w];
+
+            // same terms as CubicInterpolate
+            float64 a0 = (r[3] - r[2]) - (r[0] - r[1]);
+            ins[0] = a0;
+            ins[1] = (r[0] - r[1]) - a0;
+            ins[2] = r[2] - r[0];
+            ins[3] = r[1];
+        }
+    }
+}
+
+void ExitNoiseSource(NoiseSource* source)
+{
+    PoolFree(source->coefs);
+    source->coefs = nullptr;
+}
+
+// Horizontal cubic pass from the coefficient table. Sample i reads the
+// lattice row starting at base[i * baseStep]. Taps that wrap around a rect
+// seam aren't neighbors on the map, so those are interpolated from the raw
+// values instead. Matches CubicInterpolate exactly either way.
+void CubicRowFromCoefficients(NoiseSource const* source, uint32 const* base, uint32 baseStep,
+    uint32 const* const cols[4], float64 const* mu, float64* out, uint32 count)
+{
+    uint32 w = source->dim.w;
+    MapFloat const* data = source->map->data;
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint32 row = base[i * baseStep];
+        uint32 c = cols[1][i];
+        uint32 prev = c == 0 ? w - 1 : c - 1;
+        uint32 next = c + 1 == w ? 0 : c + 1;
+        uint32 next2 = next + 1 == w ? 0 : next + 1;
+        float64 m = mu[i];
+
+        if (cols[0][i] == prev && cols[2][i] == next && cols[3][i] == next2)
+        {
+            float64 const* a = source->coefs + (row + c) * 4;
+            float64 m2 = m * m;
+            out[i] = a[0] * m * m2 + a[1] * m2 + a[2] * m + a[3];
+        }
+        else
+        {
+            float64 r[4];
+            for (uint32 t = 0; t < 4; ++t)
+                r[t] = data[row + cols[t][i]];
+            out[i] = CubicInterpolate(r, m);
+        }
+    }
+}
+
+// splitmix64 finalizer
+inline uint64 HashLattice(uint32 seed, uint32 index)
+{
+    uint64 h = ((uint64)seed << 32 | index) + 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+// Gets the lattice value at index, which is y * w + x on the source
+inline float64 GetLatticeValue(NoiseSource const* source, uint32 index)
+{
+    if (source->map)
+        return source->map->data[index];
+
+    uint64 h = HashLattice(source->seed, index);
+    if (source->binary)
+        return (float64)(h >> 63);
+
+    // top 53 bits onto 0 - 1
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Hashed version of the gather kernel, out[i] = lattice[base + idx[i]]
+void GatherHashedRow(NoiseSource const* source, uint32 base, uint32 const* idx,
+    float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+        out[i] = GetLatticeValue(source, base + idx[i]);
+}
+
+// Gets the sampling rect for each octave. Note that in order for the
+// noise to wrap, the area sampled on the noise map must change to fit
+// each octave.
+void InitPerlinPlan(PerlinPlan* plan, NoiseSource const* source, uint16 destMapWidth,
+    float64 destMapHeight, float64 initialFrequency, uint8 octaves)
+{
+    assert(octaves > 0 && octaves <= MAX_PERLIN_OCTAVES);
+    assert(source);
+
+    plan->source = source;
+    plan->octaves = octaves;
+
+    float64 freq = initialFrequency;
+    for (int i = 0; i < octaves; ++i, freq *= 2.0)
+    {
+        OctaveRect* rect = plan->rects + i;
+
+        // TODO: clean up branching
+        if (source->wrapX)
+        {
+            int32 rX = (int32)floor(source->dim.w / 2.0 - (destMapWidth * freq) / 2.0);
+            assert(rX >= 0 - 0x7FFF && rX <= 0x7FFF);
+            rect->x = rX;
+            int32 rW = (int32)floor(destMapWidth * freq);
+            rW = std::max(rW, 1);
+            assert(rW >= 0 && rW <= 0xFFFF);
+            rect->width = rW;
+            rect->freqX = rect->width / (float64)destMapWidth;
+        }
+        else
+        {
+            rect->x = 0;
+            rect->width = source->dim.w;
+            rect->freqX = freq;
+        }
+
+        if (source->wrapY)
+        {
+            int32 rY = (int32)floor(source->dim.h / 2.0 - (destMapHeight * freq) / 2.0);
+            assert(rY >= 0 - 0x7FFF && rY <= 0x7FFF);
+            rect->y = rY;
+            int32 rH = (int32)floor(destMapHeight * freq);
+            rH = std::max(rH, 1);
+            assert(rH >= 0 && rH <= 0xFFFF);
+            rect->height = rH;
+            rect->freqY = rect->height / destMapHeight;
+        }
+        else
+        {
+            rect->y = 0;
+            rect->height = source->dim.h;
+            rect->freqY = freq;
+        }
+    }
+}
+
+// --- SIMD Kernels
+
+// The perlin row samplers spend nearly all of their time in these few
+// kernels. They are selected once at startup by InitPerlinKernels based on
+// the CPU features available. Every version performs exactly the same float64
+// operations in the same order as CubicInterpolate and CubicDerivative (no
+// fused multiply-add), so all of them produce bit identical results.
+
+// out[i] = src[idx[i]]
+typedef void (*GatherRowFn)(MapFloat const* src, uint32 const* idx, float64* out, uint32 count);
+// out[i] = Cubic*({ r[0][i], r[1][i], r[2][i], r[3][i] }, mu[i * muStep])
+typedef void (*CubicRowFn)(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count);
+// out[i] += Cubic*({ r[0][i], r[1][i], r[2][i], r[3][i] }, mu[i * muStep]) * amp[i * ampStep]
+typedef void (*CubicAccumulateRowFn)(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count);
+// a[i] *= b[i]
+typedef void (*MultiplyRowFn)(float64* a, float64 const* b, uint32 count);
+// out[i] = a[i] / d
+typedef void (*DivideRowFn)(float64 const* a, float64 d, MapFloat* out, uint32 count);
+
+struct PerlinKernels
+{
+    SimdLevel level;
+    GatherRowFn gather;
+    CubicRowFn cubic;
+    CubicAccumulateRowFn cubicAccumulate;
+    CubicRowFn cubicDerivative;
+    CubicAccumulateRowFn cubicDerivativeAccumulate;
+    MultiplyRowFn multiply;
+    DivideRowFn divide;
+};
+
+static PerlinKernels gPerlin;
+
+// Scalar
+
+static void GatherRowScalar(MapFloat const* src, uint32 const* idx, float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+        out[i] = src[idx[i]];
+}
+
+static void CubicRowScalar(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+    {
+        float64 p[4] = { r[0][i], r[1][i], r[2][i], r[3][i] };
+        out[i] = CubicInterpolate(p, mu[i * muStep]);
+    }
+}
+
+static void CubicAccumulateRowScalar(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+    {
+        float64 p[4] = { r[0][i], r[1][i], r[2][i], r[3][i] };
+        out[i] += CubicInterpolate(p, mu[i * muStep]) * amp[i * ampStep];
+    }
+}
+
+static void CubicDerivativeRowScalar(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+    {
+        float64 p[4] = { r[0][i], r[1][i], r[2][i], r[3][i] };
+        out[i] = CubicDerivative(p, mu[i * muStep]);
+    }
+}
+
+static void CubicDerivativeAccumulateRowScalar(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+    {
+        float64 p[4] = { r[0][i], r[1][i], r[2][i], r[3][i] };
+        out[i] += CubicDerivative(p, mu[i * muStep]) * amp[i * ampStep];
+    }
+}
+
+static void MultiplyRowScalar(float64* a, float64 const* b, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+        a[i] *= b[i];
+}
+
+static void DivideRowScalar(float64 const* a, float64 d, MapFloat* out, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+        out[i] = a[i] / d;
+}
+
+#if PW6_X86
+
+// SSE2, 2 tiles per instruction
+
+static inline __m128d CubicSSE2(__m128d r0, __m128d r1, __m128d r2, __m128d r3, __m128d mu)
+{
+    __m128d mu2 = _mm_mul_pd(mu, mu);
+    __m128d a0 = _mm_sub_pd(_mm_sub_pd(r3, r2), _mm_sub_pd(r0, r1));
+    __m128d a1 = _mm_sub_pd(_mm_sub_pd(r0, r1), a0);
+    __m128d a2 = _mm_sub_pd(r2, r0);
+
+    __m128d v = _mm_mul_pd(_mm_mul_pd(a0, mu), mu2);
+    v = _mm_add_pd(v, _mm_mul_pd(a1, mu2));
+    v = _mm_add_pd(v, _mm_mul_pd(a2, mu));
+    return _mm_add_pd(v, r1);
+}
+
+static inline __m128d CubicDerivativeSSE2(__m128d r0, __m128d r1, __m128d r2, __m128d r3, __m128d mu)
+{
+    __m128d mu2 = _mm_mul_pd(mu, mu);
+    __m128d a0 = _mm_sub_pd(_mm_sub_pd(r3, r2), _mm_sub_pd(r0, r1));
+    __m128d a1 = _mm_sub_pd(_mm_sub_pd(r0, r1), a0);
+    __m128d a2 = _mm_sub_pd(r2, r0);
+
+    __m128d v = _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(3.0), a0), mu2);
+    v = _mm_add_pd(v, _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(2.0), a1), mu));
+    return _mm_add_pd(v, a2);
+}
+
+static inline void StoreSSE2(float64* out, __m128d v)
+{
+    _mm_storeu_pd(out, v);
+}
+
+static inline void StoreSSE2(float32* out, __m128d v)
+{
+    _mm_storel_pi((__m64*)out, _mm_cvtpd_ps(v));
+}
+
+static void GatherRowSSE2(MapFloat const* src, uint32 const* idx, float64* out, uint32 count)
+{
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_set_pd(src[idx[i + 1]], src[idx[i]]));
+
+    GatherRowScalar(src, idx + i, out + i, count - i);
+}
+
+static void CubicRowSSE2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    __m128d m = _mm_set1_pd(*mu);
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        if (muStep)
+            m = _mm_loadu_pd(mu + i);
+        __m128d v = CubicSSE2(_mm_loadu_pd(r[0] + i), _mm_loadu_pd(r[1] + i),
+            _mm_loadu_pd(r[2] + i), _mm_loadu_pd(r[3] + i), m);
+        _mm_storeu_pd(out + i, v);
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicRowScalar(rest, mu + i * muStep, muStep, out + i, count - i);
+}
+
+static void CubicAccumulateRowSSE2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    __m128d m = _mm_set1_pd(*mu);
+    __m128d a = _mm_set1_pd(*amp);
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        if (muStep)
+            m = _mm_loadu_pd(mu + i);
+        if (ampStep)
+            a = _mm_loadu_pd(amp + i);
+        __m128d v = CubicSSE2(_mm_loadu_pd(r[0] + i), _mm_loadu_pd(r[1] + i),
+            _mm_loadu_pd(r[2] + i), _mm_loadu_pd(r[3] + i), m);
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(out + i), _mm_mul_pd(v, a)));
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicAccumulateRowScalar(rest, mu + i * muStep, muStep, amp + i * ampStep, ampStep, out + i, count - i);
+}
+
+static void CubicDerivativeRowSSE2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    __m128d m = _mm_set1_pd(*mu);
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        if (muStep)
+            m = _mm_loadu_pd(mu + i);
+        __m128d v = CubicDerivativeSSE2(_mm_loadu_pd(r[0] + i), _mm_loadu_pd(r[1] + i),
+            _mm_loadu_pd(r[2] + i), _mm_loadu_pd(r[3] + i), m);
+        _mm_storeu_pd(out + i, v);
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicDerivativeRowScalar(rest, mu + i * muStep, muStep, out + i, count - i);
+}
+
+static void CubicDerivativeAccumulateRowSSE2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    __m128d m = _mm_set1_pd(*mu);
+    __m128d a = _mm_set1_pd(*amp);
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        if (muStep)
+            m = _mm_loadu_pd(mu + i);
+        if (ampStep)
+            a = _mm_loadu_pd(amp + i);
+        __m128d v = CubicDerivativeSSE2(_mm_loadu_pd(r[0] + i), _mm_loadu_pd(r[1] + i),
+            _mm_loadu_pd(r[2] + i), _mm_loadu_pd(r[3] + i), m);
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(out + i), _mm_mul_pd(v, a)));
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicDerivativeAccumulateRowScalar(rest, mu + i * muStep, muStep, amp + i * ampStep, ampStep, out + i, count - i);
+}
+
+static void MultiplyRowSSE2(float64* a, float64 const* b, uint32 count)
+{
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+
+    MultiplyRowScalar(a + i, b + i, count - i);
+}
+
+static void DivideRowSSE2(float64 const* a, float64 d, MapFloat* out, uint32 count)
+{
+    __m128d dv = _mm_set1_pd(d);
+    uint32 i = 0;
+    for (; i + 2 <= count; i += 2)
+        StoreSSE2(out + i, _mm_div_pd(_mm_loadu_pd(a + i), dv));
+
+    DivideRowScalar(a + i, d, out + i, count - i);
+}
+
+// AVX2, 4 tiles per instruction
+
+PW6_TARGET_AVX2 static inline __m256d CubicAVX2(__m256d r0, __m256d r1, __m256d r2, __m256d r3, __m256d mu)
+{
+    __m256d mu2 = _mm256_mul_pd(mu, mu);
+    __m256d a0 = _mm256_sub_pd(_mm256_sub_pd(r3, r2), _mm256_sub_pd(r0, r1));
+    __m256d a1 = _mm256_sub_pd(_mm256_sub_pd(r0, r1), a0);
+    __m256d a2 = _mm256_sub_pd(r2, r0);
+
+    __m256d v = _mm256_mul_pd(_mm256_mul_pd(a0, mu), mu2);
+    v = _mm256_add_pd(v, _mm256_mul_pd(a1, mu2));
+    v = _mm256_add_pd(v, _mm256_mul_pd(a2, mu));
+    return _mm256_add_pd(v, r1);
+}
+
+PW6_TARGET_AVX2 static inline __m256d CubicDerivativeAVX2(__m256d r0, __m256d r1, __m256d r2, __m256d r3, __m256d mu)
+{
+    __m256d mu2 = _mm256_mul_pd(mu, mu);
+    __m256d a0 = _mm256_sub_pd(_mm256_sub_pd(r3, r2), _mm256_sub_pd(r0, r1));
+    __m256d a1 = _mm256_sub_pd(_mm256_sub_pd(r0, r1), a0);
+    __m256d a2 = _mm256_sub_pd(r2, r0);
+
+    __m256d v = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(3.0), a0), mu2);
+    v = _mm256_add_pd(v, _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), a1), mu));
+    return _mm256_add_pd(v, a2);
+}
+
+PW6_TARGET_AVX2 static inline __m256d GatherAVX2(float64 const* src, __m128i ind)
+{
+    return _mm256_i32gather_pd(src, ind, sizeof(float64));
+}
+
+PW6_TARGET_AVX2 static inline __m256d GatherAVX2(float32 const* src, __m128i ind)
+{
+    return _mm256_cvtps_pd(_mm_i32gather_ps(src, ind, sizeof(float32)));
+}
+
+PW6_TARGET_AVX2 static inline void StoreAVX2(float64* out, __m256d v)
+{
+    _mm256_storeu_pd(out, v);
+}
+
+PW6_TARGET_AVX2 static inline void StoreAVX2(float32* out, __m256d v)
+{
+    _mm_storeu_ps(out, _mm256_cvtpd_ps(v));
+}
+
+PW6_TARGET_AVX2 static void GatherRowAVX2(MapFloat const* src, uint32 const* idx, float64* out, uint32 count)
+{
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i ind = _mm_loadu_si128((__m128i const*)(idx + i));
+        _mm256_storeu_pd(out + i, GatherAVX2(src, ind));
+    }
+
+    GatherRowScalar(src, idx + i, out + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void CubicRowAVX2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    __m256d m = _mm256_set1_pd(*mu);
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        if (muStep)
+            m = _mm256_loadu_pd(mu + i);
+        __m256d v = CubicAVX2(_mm256_loadu_pd(r[0] + i), _mm256_loadu_pd(r[1] + i),
+            _mm256_loadu_pd(r[2] + i), _mm256_loadu_pd(r[3] + i), m);
+        _mm256_storeu_pd(out + i, v);
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicRowScalar(rest, mu + i * muStep, muStep, out + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void CubicAccumulateRowAVX2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    __m256d m = _mm256_set1_pd(*mu);
+    __m256d a = _mm256_set1_pd(*amp);
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        if (muStep)
+            m = _mm256_loadu_pd(mu + i);
+        if (ampStep)
+            a = _mm256_loadu_pd(amp + i);
+        __m256d v = CubicAVX2(_mm256_loadu_pd(r[0] + i), _mm256_loadu_pd(r[1] + i),
+            _mm256_loadu_pd(r[2] + i), _mm256_loadu_pd(r[3] + i), m);
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(out + i), _mm256_mul_pd(v, a)));
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicAccumulateRowScalar(rest, mu + i * muStep, muStep, amp + i * ampStep, ampStep, out + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void CubicDerivativeRowAVX2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64* out, uint32 count)
+{
+    __m256d m = _mm256_set1_pd(*mu);
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        if (muStep)
+            m = _mm256_loadu_pd(mu + i);
+        __m256d v = CubicDerivativeAVX2(_mm256_loadu_pd(r[0] + i), _mm256_loadu_pd(r[1] + i),
+            _mm256_loadu_pd(r[2] + i), _mm256_loadu_pd(r[3] + i), m);
+        _mm256_storeu_pd(out + i, v);
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicDerivativeRowScalar(rest, mu + i * muStep, muStep, out + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void CubicDerivativeAccumulateRowAVX2(float64 const* const r[4], float64 const* mu, uint32 muStep,
+    float64 const* amp, uint32 ampStep, float64* out, uint32 count)
+{
+    __m256d m = _mm256_set1_pd(*mu);
+    __m256d a = _mm256_set1_pd(*amp);
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        if (muStep)
+            m = _mm256_loadu_pd(mu + i);
+        if (ampStep)
+            a = _mm256_loadu_pd(amp + i);
+        __m256d v = CubicDerivativeAVX2(_mm256_loadu_pd(r[0] + i), _mm256_loadu_pd(r[1] + i),
+            _mm256_loadu_pd(r[2] + i), _mm256_loadu_pd(r[3] + i), m);
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(out + i), _mm256_mul_pd(v, a)));
+    }
+
+    float64 const* rest[4] = { r[0] + i, r[1] + i, r[2] + i, r[3] + i };
+    CubicDerivativeAccumulateRowScalar(rest, mu + i * muStep, muStep, amp + i * ampStep, ampStep, out + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void MultiplyRowAVX2(float64* a, float64 const* b, uint32 count)
+{
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+
+    MultiplyRowScalar(a + i, b + i, count - i);
+}
+
+PW6_TARGET_AVX2 static void DivideRowAVX2(float64 const* a, float64 d, MapFloat* out, uint32 count)
+{
+    __m256d dv = _mm256_set1_pd(d);
+    uint32 i = 0;
+    for (; i + 4 <= count; i += 4)
+        StoreAVX2(out + i, _mm256_div_pd(_mm256_loadu_pd(a + i), dv));
+
+    DivideRowScalar(a + i, d, out + i, count - i);
+}
+
+#endif // PW6_X86
+
+static SimdLevel DetectSimdLevel()
+{
+#if PW6_X86
+    bool avx2 = false;
+#if defined(_MSC_VER)
+    int32 info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    __cpuidex(info, 7, 0);
+    // the OS also has to preserve the ymm registers
+    avx2 = osxsave && avx && (info[1] & (1 << 5)) && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    // SSE2 is part of the x64 baseline
+    return avx2 ? slAVX2 : slSSE2;
+#else
+    return slScalar;
+#endif
+}
+
+// maxLevel caps the detected level, slAuto uses the best available
+void InitPerlinKernels(SimdLevel maxLevel)
+{
+    SimdLevel level = DetectSimdLevel();
+    if (maxLevel != slAuto && maxLevel < level)
+        level = maxLevel;
+
+    gPerlin.level = slScalar;
+    gPerlin.gather = GatherRowScalar;
+    gPerlin.cubic = CubicRowScalar;
+    gPerlin.cubicAccumulate = CubicAccumulateRowScalar;
+    gPerlin.cubicDerivative = CubicDerivativeRowScalar;
+    gPerlin.cubicDerivativeAccumulate = CubicDerivativeAccumulateRowScalar;
+    gPerlin.multiply = MultiplyRowScalar;
+    gPerlin.divide = DivideRowScalar;
+
+#if PW6_X86
+    if (level == slSSE2)
+    {
+        gPerlin.level = slSSE2;
+        gPerlin.gather = GatherRowSSE2;
+        gPerlin.cubic = CubicRowSSE2;
+        gPerlin.cubicAccumulate = CubicAccumulateRowSSE2;
+        gPerlin.cubicDerivative = CubicDerivativeRowSSE2;
+        gPerlin.cubicDerivativeAccumulate = CubicDerivativeAccumulateRowSSE2;
+        gPerlin.multiply = MultiplyRowSSE2;
+        gPerlin.divide = DivideRowSSE2;
+    }
+    else if (level == slAVX2)
+    {
+        gPerlin.level = slAVX2;
+        gPerlin.gather = GatherRowAVX2;
+        gPerlin.cubic = CubicRowAVX2;
+        gPerlin.cubicAccumulate = CubicAccumulateRowAVX2;
+        gPerlin.cubicDerivative = CubicDerivativeRowAVX2;
+        gPerlin.cubicDerivativeAccumulate = CubicDerivativeAccumulateRowAVX2;
+        gPerlin.multiply = MultiplyRowAVX2;
+        gPerlin.divide = DivideRowAVX2;
+    }
+#endif
+
+    static char const* names[] = { "auto", "scalar", "SSE2", "AVX2" };
+    printf("Perlin kernels: %s\n", names[gPerlin.level]);
+}
+
+
+// --- Row Sampling
+
+void InitPerlinRowScratch(PerlinRowScratch* scratch, uint32 capacity)
+{
+    scratch->capacity = capacity;
+    scratch->cols = (uint32*)PoolAlloc(capacity * 4 * sizeof(uint32));
+    scratch->muX = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->muY = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->amp = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->taps = (float64*)PoolAlloc(capacity * 4 * sizeof(float64));
+    scratch->rows = (float64*)PoolAlloc(capacity * 4 * sizeof(float64));
+    scratch->slopes = (float64*)PoolAlloc(capacity * 4 * sizeof(float64));
+    scratch->sums = (float64*)PoolAlloc(capacity * MAX_PERLIN_CHANNELS * sizeof(float64));
+    scratch->sampleX = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->sampleY = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->sampleAmpChange = (float64*)PoolAlloc(capacity * sizeof(float64));
+    scratch->srcRows = (uint32*)PoolAlloc(capacity * 4 * sizeof(uint32));
+    scratch->gatherIdx = (uint32*)PoolAlloc(capacity * sizeof(uint32));
+}
+
+void ExitPerlinRowScratch(PerlinRowScratch* scratch)
+{
+    PoolFree(scratch->gatherIdx);
+    PoolFree(scratch->srcRows);
+    PoolFree(scratch->sampleAmpChange);
+    PoolFree(scratch->sampleY);
+    PoolFree(scratch->sampleX);
+    PoolFree(scratch->sums);
+    PoolFree(scratch->slopes);
+    PoolFree(scratch->rows);
+    PoolFree(scratch->taps);
+    PoolFree(scratch->amp);
+    PoolFree(scratch->muY);
+    PoolFree(scratch->muX);
+    PoolFree(scratch->cols);
+}
+
+// Wraps a rect local coordinate onto the map. Wrapping is assumed in both
+// directions
+inline uint32 WrapRectCoord(int32 v, int32 rectStart, int32 rectSize, int32 dimSize)
+{
+    int32 m = rectStart + (v % rectSize);
+    m %= dimSize;
+    if (m < 0)
+        m += dimSize;
+
+    return (uint32)m;
+}
+
+// Gets the 4 wrapped source coordinates around sample coordinate s, so that
+// s lands in the middle pair, and returns its fractional part
+inline float64 GetSourceTaps(float64 s, int32 rectStart, int32 rectSize, int32 dimSize,
+    uint32* taps, uint32 tapStride)
+{
+    int32 f = floor(s);
+    int32 wrapped = ((f - 1) % rectSize) + rectStart;
+    for (int32 p = 0; p < 4; ++p)
+        taps[p * tapStride] = WrapRectCoord(p + wrapped, rectStart, rectSize, dimSize);
+
+    return s - f;
+}
+
+// Samples the row from every source with the octave rects of plan. The
+// sample coordinates and weights only depend on the plan, so they're worked
+// out once per octave and shared by all of the channels.
+static void SamplePerlinRow(float64 xStart, float64 y, uint32 count,
+    float64 initialAmplitude, float64 amplitudeChange, PerlinPlan const* plan,
+    NoiseSource const* const* sources, uint32 channels,
+    PerlinRowScratch* scratch, MapFloat* const* outs)
+{
+    assert(count <= scratch->capacity);
+    assert(channels > 0 && channels <= MAX_PERLIN_CHANNELS);
+
+    int32 w = plan->source->dim.w;
+    int32 h = plan->source->dim.h;
+    uint32* cols[4];
+    float64* taps[4];
+    float64* rows[4];
+    for (uint32 t = 0; t < 4; ++t)
+    {
+        cols[t] = scratch->cols + t * count;
+        taps[t] = scratch->taps + t * count;
+        rows[t] = scratch->rows + t * count;
+    }
+    float64* muX = scratch->muX;
+    float64* sums[MAX_PERLIN_CHANNELS];
+    for (uint32 c = 0; c < channels; ++c)
+    {
+        // the rects index every source the same way
+        assert(sources[c]->dim.w == w && sources[c]->dim.h == h);
+        sums[c] = scratch->sums + c * count;
+        for (uint32 i = 0; i < count; ++i)
+            sums[c][i] = 0.0;
+    }
+
+    float64 amp = initialAmplitude;
+
+    for (int o = 0; o < plan->octaves; ++o)
+    {
+        OctaveRect const* rect = plan->rects + o;
+
+        // the 4 source rows are shared by the whole row
+        uint32 srcRows[4];
+        float64 muY = GetSourceTaps(y * rect->freqY, rect->y, rect->height, h, srcRows, 1);
+
+        // the 4 source columns per sample are shared by every source row
+        for (uint32 i = 0; i < count; ++i)
+            muX[i] = GetSourceTaps((xStart + i) * rect->freqX, rect->x, rect->width, w, cols[0] + i, count);
+
+        for (uint32 c = 0; c < channels; ++c)
+        {
+            NoiseSource const* source = sources[c];
+
+            // horizontal pass
+            for (uint32 pY = 0; pY < 4; ++pY)
+            {
+                uint32 row = srcRows[pY] * w;
+                if (source->coefs)
+                {
+                    CubicRowFromCoefficients(source, &row, 0, cols, muX, rows[pY], count);
+                    continue;
+                }
+
+                for (uint32 t = 0; t < 4; ++t)
+                {
+                    if (source->map)
+                        gPerlin.gather(source->map->data + row, cols[t], taps[t], count);
+                    else
+                        GatherHashedRow(source, row, cols[t], taps[t], count);
+                }
+
+                gPerlin.cubic(taps, muX, 1, rows[pY], count);
+            }
+
+            // vertical pass
+            gPerlin.cubicAccumulate(rows, &muY, 0, &amp, 0, sums[c], count);
+        }
+
+        amp *= amplitudeChange;
+    }
+
+    for (uint32 c = 0; c < channels; ++c)
+        gPerlin.divide(sums[c], plan->octaves, outs[c], count);
+}
+
+// This function gets Perlin noise for a row of the destination map using a
+// plan built by InitPerlinPlan. Samples count values along a row where sample
+// i is at (xStart + i, y) and writes them to out. Since every sample on the
+// row shares the same 4 source rows per octave, the source rows and the
+// horizontal cubic pass are done once for the whole row before the vertical
+// pass.
+void GetPerlinNoiseRow(float64 xStart, float64 y, uint32 count,
+    float64 initialAmplitude, float64 amplitudeChange, PerlinPlan const* plan,
+    PerlinRowScratch* scratch, MapFloat* out)
+{
+    SamplePerlinRow(xStart, y, count, initialAmplitude, amplitudeChange, plan,
+        &plan->source, 1, scratch, &out);
+}
+
+// Multi channel version of GetPerlinNoiseRow. Samples the same row from each
+// of sources with the octave setup of plan and writes them to outs, so maps
+// that only differ by their input noise share a single coordinate walk.
+// sources must all have the dimensions of plan's source. Each channel is
+// identical to a separate GetPerlinNoiseRow call with its own plan.
+void GetPerlinNoiseRows(float64 xStart, float64 y, uint32 count,
+    float64 initialAmplitude, float64 amplitudeChange, PerlinPlan const* plan,
+    NoiseSource const* const* sources, uint32 channels,
+    PerlinRowScratch* scratch, MapFloat* const* outs)
+{
+    SamplePerlinRow(xStart, y, count, initialAmplitude, amplitudeChange, plan,
+        sources, channels, scratch, outs);
+}
+
+// Gets Perlin noise for a row like GetPerlinNoiseRow along with its slope
+// along x and y. Each octave gathers its 16 points per sample once and runs
+// both the cubic and its derivative over them. value matches
+// GetPerlinNoiseRow exactly. The slopes are per destination tile, so each
+// octave is scaled by the float64 frequencies of its rect.
+void GetPerlinGradientRow(float64 xStart, float64 y, uint32 count,
+    float64 initialAmplitude, float64 amplitudeChange, PerlinPlan const* plan,
+    PerlinRowScratch* scratch, MapFloat* value, MapFloat* dx, MapFloat* dy)
+{
+    assert(count <= scratch->capacity);
+    STATIC_ASSERT(MAX_PERLIN_CHANNELS >= 3);
+
+    NoiseSource const* source = plan->source;
+    int32 w = source->dim.w;
+    int32 h = source->dim.h;
+    uint32* cols[4];
+    float64* taps[4];
+    float64* rows[4];
+    float64* slopes[4];
+    for (uint32 t = 0; t < 4; ++t)
+    {
+        cols[t] = scratch->cols + t * count;
+        taps[t] = scratch->taps + t * count;
+        rows[t] = scratch->rows + t * count;
+        slopes[t] = scratch->slopes + t * count;
+    }
+    float64* muX = scratch->muX;
+    // value, x slope and y slope
+    float64* sums[3];
+    for (uint32 c = 0; c < 3; ++c)
+    {
+        sums[c] = scratch->sums + c * count;
+        for (uint32 i = 0; i < count; ++i)
+            sums[c][i] = 0.0;
+    }
+
+    float64 amp = initialAmplitude;
+
+    for (int o = 0; o < plan->octaves; ++o)
+    {
+        OctaveRect const* rect = plan->rects + o;
+
+        uint32 srcRows[4];
+        float64 muY = GetSourceTaps(y * rect->freqY, rect->y, rect->height, h, srcRows, 1);
+
+        for (uint32 i = 0; i < count; ++i)
+            muX[i] = GetSourceTaps((xStart + i) * rect->freqX, rect->x, rect->width, w, cols[0] + i, count);
+
+        // horizontal pass, the taps are needed for the slopes so the
+        // coefficient table isn't used
+        for (uint32 pY = 0; pY < 4; ++pY)
+        {
+            uint32 row = srcRows[pY] * w;
+            for (uint32 t = 0; t < 4; ++t)
+            {
+                if (source->map)
+                    gPerlin.gather(source->map->data + row, cols[t], taps[t], count);
+                else
+                    GatherHashedRow(source, row, cols[t], taps[t], count);
+            }
+
+            gPerlin.cubic(taps, muX, 1, rows[pY], count);
+            gPerlin.cubicDerivative(taps, muX, 1, slopes[pY], count);
+        }
+
+        // vertical pass
+        float64 ampX = amp * rect->freqX;
+        float64 ampY = amp * rect->freqY;
+        gPerlin.cubicAccumulate(rows, &muY, 0, &amp, 0, sums[0], count);
+        gPerlin.cubicAccumulate(slopes, &muY, 0, &ampX, 0, sums[1], count);
+        gPerlin.cubicDerivativeAccumulate(rows, &muY, 0, &ampY, 0, sums[2], count);
+
+        amp *= amplitudeChange;
+    }
+
+    gPerlin.divide(sums[0], plan->octaves, value, count);
+    gPerlin.divide(sums[1], plan->octaves, dx, count);
+    gPerlin.divide(sums[2], plan->octaves, dy, count);
+}
+
+// Samples every few rows of a hashed noise source with GetPerlinGradientRow
+// and checks the values against GetPerlinNoiseRow and the slopes against
+// central differences of it
+void ReportPerlinGradient(Dim dim)
+{
+    NoiseSource source;
+    InitHashedNoiseSource(&source, dim, true, true, false, 1);
+    PerlinPlan plan;
+    InitPerlinPlan(&plan, &source, dim.w, dim.h, 0.05, 8);
+    PerlinRowScratch scratch;
+    InitPerlinRowScratch(&scratch, dim.w);
+
+    MapFloat* value = (MapFloat*)PoolAlloc(dim.w * 8 * sizeof *value);
+    MapFloat* dx = value + dim.w;
+    MapFloat* dy = dx + dim.w;
+    MapFloat* noise = dy + dim.w;
+    MapFloat* left = noise + dim.w;
+    MapFloat* right = left + dim.w;
+    MapFloat* up = right + dim.w;
+    MapFloat* down = up + dim.w;
+
+    float64 const step = 1.0 / 1024;
+    uint32 valueDiffs = 0;
+    uint32 samples = 0;
+    float64 maxSlope = 0.0;
+    float64 maxError = 0.0;
+
+    // starting a tile in keeps the differences off negative coordinates
+    for (uint32 y = 1; y < dim.h; y += 5)
+    {
+        float64 xStart = 1.0 + (y % 2) * 0.5;
+        GetPerlinGradientRow(xStart, y, dim.w, 1.0, 0.5, &plan, &scratch, value, dx, dy);
+        GetPerlinNoiseRow(xStart, y, dim.w, 1.0, 0.5, &plan, &scratch, noise);
+        GetPerlinNoiseRow(xStart - step, y, dim.w, 1.0, 0.5, &plan, &scratch, left);
+        GetPerlinNoiseRow(xStart + step, y, dim.w, 1.0, 0.5, &plan, &scratch, right);
+        GetPerlinNoiseRow(xStart, y - step, dim.w, 1.0, 0.5, &plan, &scratch, up);
+        GetPerlinNoiseRow(xStart, y + step, dim.w, 1.0, 0.5, &plan, &scratch, down);
+
+        for (uint32 i = 0; i < dim.w; ++i)
+        {
+            valueDiffs += value[i] != noise[i];
+            float64 diffX = (right[i] - left[i]) / (2 * step);
+            float64 diffY = (down[i] - up[i]) / (2 * step);
+            maxError = std::max(maxError, std::max(fabs(diffX - dx[i]), fabs(diffY - dy[i])));
+            maxSlope = std::max(maxSlope, std::max(fabs(dx[i]), fabs(dy[i])));
+        }
+        samples += dim.w;
+    }
+
+    printf("Perlin gradient report:\n");
+    printf("   values differ from GetPerlinNoiseRow on %u of %u samples\n", valueDiffs, samples);
+    printf("   slopes differ from central differences by at most %.3g, the steepest is %.3g\n", maxError, maxSlope);
+    if (valueDiffs || maxError > maxSlope * 0.01)
+        printf("ERROR - The perlin gradient doesn't match the noise it was sampled from.\n");
+
+    PoolFree(value);
+    ExitPerlinRowScratch(&scratch);
+}
+
+// Batched version of GetPerlinNoiseRow for samples that don't share a row.
+// Sample i is at (scratch->sampleX[i], scratch->sampleY[i]) with an amplitude
+// change of scratch->sampleAmpChange[i]. Each sample gathers its own 16 points,
+// but the cubic passes and the octave updates still run across the whole batch.
+void GetPerlinNoiseBatch(uint32 count, float64 initialAmplitude,
+    PerlinPlan const* plan, PerlinRowScratch* scratch, MapFloat* out)
+{
+    assert(count <= scratch->capacity);
+
+    NoiseSource const* source = plan->source;
+    int32 w = source->dim.w;
+    int32 h = source->dim.h;
+    uint32* cols[4];
+    float64* taps[4];
+    float64* rows[4];
+    for (uint32 t = 0; t < 4; ++t)
+    {
+        cols[t] = scratch->cols + t * count;
+        taps[t] = scratch->taps + t * count;
+        rows[t] = scratch->rows + t * count;
+    }
+    float64* muX = scratch->muX;
+    float64* muY = scratch->muY;
+    float64* amp = scratch->amp;
+    float64* sums = scratch->sums;
+    uint32* srcRows[4];
+    for (uint32 t = 0; t < 4; ++t)
+        srcRows[t] = scratch->srcRows + t * count;
+    uint32* idx = scratch->gatherIdx;
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        sums[i] = 0.0;
+        amp[i] = initialAmplitude;
+    }
+
+    for (int o = 0; o < plan->octaves; ++o)
+    {
+        OctaveRect const* rect = plan->rects + o;
+
+        for (uint32 i = 0; i < count; ++i)
+        {
+            muX[i] = GetSourceTaps(scratch->sampleX[i] * rect->freqX, rect->x, rect->width, w, cols[0] + i, count);
+            muY[i] = GetSourceTaps(scratch->sampleY[i] * rect->freqY, rect->y, rect->height, h, srcRows[0] + i, count);
+        }
+
+        // horizontal pass
+        for (uint32 pY = 0; pY < 4; ++pY)
+        {
+            if (source->coefs)
+            {
+                for (uint32 i = 0; i < count; ++i)
+                    idx[i] = srcRows[pY][i] * w;
+                CubicRowFromCoefficients(source, idx, 1, cols, muX, rows[pY], count);
+                continue;
+            }
+
+            for (uint32 t = 0; t < 4; ++t)
+            {
+                for (uint32 i = 0; i < count; ++i)
+                    idx[i] = srcRows[pY][i] * w + cols[t][i];
+                if (source->map)
+                    gPerlin.gather(source->map->data, idx, taps[t], count);
+                else
+                    GatherHashedRow(source, 0, idx, taps[t], count);
+            }
+
+            gPerlin.cubic(taps, muX, 1, rows[pY], count);
+        }
+
+        // vertical pass
+        gPerlin.cubicAccumulate(rows, muY, 1, amp, 1, sums, count);
+
+        gPerlin.multiply(amp, scratch->sampleAmpChange, count);
+    }
+
+    gPerlin.divide(sums, plan->octaves, out, count);
+}
+
+
+// --- Member Functions -------------------------------------------------------------
+
+// --- MapTile
+
+inline bool IsWater(MapTile* tile)
+{
+    return tile->terrain < tWaterEnd;
+}
+
+// --- PaddedMap
+
+template <typename T>
+void InitPaddedMap(PaddedMapT<T>* map, Dim dim, bool wrapX, bool wrapY, uint16 halo)
+{
+    assert(!map->storage);
+
+    map->dim = dim;
+    map->halo = halo;
+    map->stride = dim.w + 2 * halo;
+    map->wrapX = wrapX;
+    map->wrapY = wrapY;
+
+    map->storage = (T*)PoolCalloc(map->stride * (dim.h + 2 * halo), sizeof *map->storage);
+    map->data = map->storage + halo * map->stride + halo;
+}
+
+template <typename T>
+void ExitPaddedMap(PaddedMapT<T>* map)
+{
+    PoolFree(map->storage);
+    map->storage = nullptr;
+    map->data = nullptr;
+}
+
+// Wraps c onto 0 - size. Coordinates stepped off the west or south edge
+// underflow to 65535, which older versions wrapped from there. With
+// signedEdgeWrap they're read as signed and land on the opposite edge.
+inline int32 WrapCoord(uint16 c, int32 size)
+{
+    if (!gSet.signedEdgeWrap)
+        return c % size;
+
+    int32 m = (int16)c % size;
+    return m < 0 ? m + size : m;
+}
+
+// Fills the halo from the interior after it changes. Halo tiles past an edge
+// that wraps copy the tile GetIndex would wrap to, otherwise they are zero.
+template <typename T>
+void RefreshHalo(PaddedMapT<T>* map)
+{
+    int32 w = map->dim.w;
+    int32 h = map->dim.h;
+    int32 halo = map->halo;
+
+    // the sides of the interior rows
+    for (int32 y = 0; y < h; ++y)
+    {
+        T* row = map->data + y * map->stride;
+        for (int32 x = -halo; x < 0; ++x)
+            row[x] = map->wrapX ? row[WrapCoord((uint16)x, w)] : 0;
+        for (int32 x = w; x < w + halo; ++x)
+            row[x] = map->wrapX ? row[WrapCoord((uint16)x, w)] : 0;
+    }
+
+    // then whole rows, which takes care of the corners
+    uint32 rowSize = map->stride * sizeof *map->data;
+    auto fillRow = [&](int32 y)
+    {
+        T* row = map->data + y * (int32)map->stride - halo;
+        if (map->wrapY)
+            memcpy(row, map->data + WrapCoord((uint16)y, h) * map->stride - halo, rowSize);
+        else
+            memset(row, 0, rowSize);
+    };
+
+    for (int32 y = -halo; y < 0; ++y)
+        fillRow(y);
+    for (int32 y = h; y < h + halo; ++y)
+        fillRow(y);
+}
+
+void CopyToPaddedMap(FloatMap const* src, PaddedMap* dst)
+{
+    assert(src->dim.w == dst->dim.w && src->dim.h == dst->dim.h);
+
+    for (uint32 y = 0; y < src->dim.h; ++y)
+        memcpy(dst->data + y * dst->stride, src->data + y * src->dim.w,
+            src->dim.w * sizeof *src->data);
+
+    RefreshHalo(dst);
+}
+
+// 1 for every tile on the map once wrapping is taken into account, 0 for
+// the halo past edges that don't wrap
+void InitOnMapMask(PaddedMapT<uint8>* mask, Dim dim, bool wrapX, bool wrapY, uint16 halo)
+{
+    InitPaddedMap(mask, dim, wrapX, wrapY, halo);
+
+    for (uint32 y = 0; y < dim.h; ++y)
+        memset(mask->data + y * mask->stride, 1, dim.w);
+
+    RefreshHalo(mask);
+}
+
+// --- FloatMap
+
+void InitFloatMap(FloatMap * map, Dim dim, bool wrapX, bool wrapY)
+{
+    assert(map);
+    assert(!map->data);
+
+    map->dim = dim;
+    map->length = dim.w * dim.h;
+    map->wrapX = wrapX;
+    map->wrapY = wrapY;
+
+    map->data = (MapFloat*)PoolCalloc(map->length, sizeof(*map->data));
+}
+
+void ExitFloatMap(FloatMap* map)
+{
+    PoolFree(map->data);
+    map->data = nullptr;
+}
+
+void GetNeighbor(FloatMap *, Coord coord, Dir dir, Coord * out)
+{
+    assert(dir < dNum);
+    HexOffset offset = hexNeighborOffsets[coord.y % 2][dir];
+
+    out->x = coord.x + offset.x;
+    out->y = coord.y + offset.y;
+}
+
+uint32 GetIndex(FloatMap const* map, Coord coord)
+{
+    int32 x = 0, y = 0;
+
+    if (map->wrapX)
+        x = WrapCoord(coord.x, map->dim.w);
+    else if (coord.x > map->dim.w - 1)
+        return UINT32_MAX;
+    else
+        x = coord.x;
+
+    if (map->wrapY)
+        y = WrapCoord(coord.y, map->dim.h);
+    else if (coord.y > map->dim.h - 1)
+        return UINT32_MAX;
+    else
+        y = coord.y;
+
+    return y * map->dim.w + x;
+}
+
+// --- HexTopology
+
+void InitHexTopology(HexTopology* topo, Dim dim, bool wrapX, bool wrapY)
+{
+    topo->dim = dim;
+    topo->wrapX = wrapX;
+    topo->wrapY = wrapY;
+
+    int32 w = dim.w;
+    int32 h = dim.h;
+    topo->keys = (uint8*)PoolAlloc(w * h * sizeof *topo->keys);
+
+    uint8* ins = topo->keys;
+    for (int32 y = 0; y < h; ++y)
+        for (int32 x = 0; x < w; ++x, ++ins)
+            *ins = (y % 2 ? hkOdd : 0) |
+                (x == 0 ? hkWest : 0) |
+                (x == w - 1 ? hkEast : 0) |
+                (y == 0 ? hkSouth : 0) |
+                (y == h - 1 ? hkNorth : 0);
+
+    // the same rules GetIndex applies to a stepped coordinate
+    for (uint32 key = 0; key < HEX_KEYS; ++key)
+    {
+        for (uint32 dir = dC; dir < dNum; ++dir)
+        {
+            HexOffset offset = hexNeighborOffsets[key & hkOdd][dir];
+            int32 dx = offset.x;
+            int32 dy = offset.y;
+            bool off = false;
+
+            if ((dx < 0 && (key & hkWest)) || (dx > 0 && (key & hkEast)))
+            {
+                if (wrapX)
+                {
+                    int32 x = key & hkWest ? 0 : w - 1;
+                    dx = WrapCoord((uint16)(x + dx), w) - x;
+                }
+                else
+                    off = true;
+            }
+
+            if ((dy < 0 && (key & hkSouth)) || (dy > 0 && (key & hkNorth)))
+            {
+                if (wrapY)
+                {
+                    int32 y = key & hkSouth ? 0 : h - 1;
+                    dy = WrapCoord((uint16)(y + dy), h) - y;
+                }
+                else
+                    off = true;
+            }
+
+            topo->deltas[key][dir] = dy * w + dx;
+            topo->offMap[key][dir] = off ? UINT32_MAX : 0;
+        }
+    }
+}
+
+void ExitHexTopology(HexTopology* topo)
+{
+    PoolFree(topo->keys);
+    topo->keys = nullptr;
+}
+
+// Gets the topology matching the size and wrap of map
+HexTopology const* GetHexTopology(FloatMap const* map)
+{
+    HexTopology const* topo = gHex + (map->wrapX * 2 + map->wrapY);
+    assert(topo->keys);
+    assert(topo->dim.w == map->dim.w && topo->dim.h == map->dim.h);
+    return topo;
+}
+
+// Index version of GetNeighbor followed by GetIndex. Returns UINT32_MAX
+// when the neighbor is off the map.
+uint32 GetNeighborIndex(HexTopology const* topo, uint32 i, Dir dir)
+{
+    uint8 key = topo->keys[i];
+    return (i + topo->deltas[key][dir]) | topo->offMap[key][dir];
+}
+
+// Gets the indices of all 6 neighbors of tile i in Dir order, starting with
+// dW. Neighbors off the map are UINT32_MAX.
+void GetNeighborIndices(HexTopology const* topo, uint32 i, uint32 out[6])
+{
+    uint8 key = topo->keys[i];
+    int32 const* deltas = topo->deltas[key] + dW;
+    uint32 const* offMap = topo->offMap[key] + dW;
+
+    for (uint32 n = 0; n < 6; ++n)
+        out[n] = (i + deltas[n]) | offMap[n];
+}
+
+// TODO: Don't use
+Coord GetXYFromIndex(FloatMap* map, uint32 ind)
+{
+    return { (uint16)(ind % map->dim.w), (uint16)(ind / map->dim.w) };
+}
+
+// quadrants are labeled
+// A B
+// D C
+Quadrant GetQuadrant(FloatMap* map, Coord coord)
+{
+    // TODO: convert to pure math
+    if (coord.x < map->dim.w / 2)
+    {
+        if (coord.y < map->dim.h / 2)
+            return qA;
+        else
+            return qD;
+    }
+    else
+    {
+        if (coord.y < map->dim.h / 2)
+            return qB;
+        else
+            return qC;
+    }
+}
+
+inline void InitRange(Range* range)
+{
+    range->min = INFINITY;
+    range->max = -INFINITY;
+}
+
+inline void TrackRange(Range* range, float64 val)
+{
+    if (val < range->min)
+        range->min = val;
+    if (val > range->max)
+        range->max = val;
+}
+
+inline void TrackRange(Range* range, MapFloat const* data, uint32 count)
+{
+    for (uint32 i = 0; i < count; ++i)
+        TrackRange(range, data[i]);
+}
+
+inline void MergeRange(Range* range, Range other)
+{
+    TrackRange(range, other.min);
+    TrackRange(range, other.max);
+}
+
+
+// --- Map Kernels
+
+// Maps with fewer tiles than this aren't worth splitting across the workers
+#define KERNEL_PARALLEL_MIN 65536
+// Reductions work on blocks of this many tiles, merged in block order, so
+// their result doesn't depend on the number of workers
+#define KERNEL_BLOCK 4096
+
+// Calls fn(begin, end) over [0, count), split across the workers when there
+// are at least minCount elements
+template <typename Fn>
+void KernelFor(uint32 count, uint32 minCount, Fn fn)
+{
+    if (count < minCount)
+        fn(0u, count);
+    else
+        ParallelFor(count, fn);
+}
+
+// Sets every tile of out to fn(i). fn is inlined, so simple ones vectorize
+template <typename Fn>
+void MapKernel(FloatMap* out, Fn fn)
+{
+    MapFloat* data = out->data;
+
+    KernelFor(out->length, KERNEL_PARALLEL_MIN, [&](uint32 begin, uint32 end)
+    {
+        for (uint32 i = begin; i < end; ++i)
+            data[i] = fn(i);
+    });
+}
+
+// Reduces [0, count) one KERNEL_BLOCK at a time. Each block starts from init
+// and calls accum(&acc, i) for its elements in order, then the blocks are
+// combined with merge(&acc, block) in order as well
+template <typename T, typename AccumFn, typename MergeFn>
+T MapReduce(uint32 count, T init, AccumFn accum, MergeFn merge)
+{
+    uint32 blocks = (count + KERNEL_BLOCK - 1) / KERNEL_BLOCK;
+    T* partials = (T*)PoolAlloc(blocks * sizeof(T));
+
+    KernelFor(blocks, KERNEL_PARALLEL_MIN / KERNEL_BLOCK, [&](uint32 begin, uint32 end)
+    {
+        for (uint32 b = begin; b < end; ++b)
+        {
+            T acc = init;
+            uint32 last = std::min(count, (b + 1) * KERNEL_BLOCK);
+            for (uint32 i = b * KERNEL_BLOCK; i < last; ++i)
+                accum(&acc, i);
+            partials[b] = acc;
+        }
+    });
+
+    T result = init;
+    for (uint32 b = 0; b < blocks; ++b)
+        merge(&result, partials[b]);
+
+    PoolFree(partials);
+    return result;
+}
+
+// Sets every tile of out to fn(i) and returns the range of what was stored
+template <typename Fn>
+Range MapKernelRange(FloatMap* out, Fn fn)
+{
+    MapFloat* data = out->data;
+    Range init;
+    InitRange(&init);
+
+    return MapReduce(out->length, init,
+        [&](Range* range, uint32 i)
+        {
+            MapFloat val = fn(i);
+            data[i] = val;
+            range->min = val < range->min ? val : range->min;
+            range->max = val > range->max ? val : range->max;
+        },
+        [](Range* range, Range block) { MergeRange(range, block); });
+}
+
+Range GetRange(FloatMap* map)
+{
+    MapFloat const* data = map->data;
+    Range init;
+    InitRange(&init);
+
+    return MapReduce(map->length, init,
+        [&](Range* range, uint32 i) { TrackRange(range, data[i]); },
+        [](Range* range, Range block) { MergeRange(range, block); });
+}
+
+// Offset and scale that map a Range onto 0 - 1
+struct RangeScale
+{
+    float64 offset;
+    float64 scale;
+};
+
+inline RangeScale GetRangeScale(Range range)
+{
+    float64 minAlt = range.min;
+    // subract minAlt also from maxAlt
+    float64 maxAlt = range.max - minAlt;
+
+    return { minAlt, maxAlt <= 0 ? 0.0 : 1.0 / maxAlt };
+}
+
+// Gets the value that normalizing the map would have stored. Consumers that
+// read a map only once can use this to skip normalizing it altogether
+inline MapFloat ApplyRangeScale(RangeScale rs, MapFloat val)
+{
+    // subtract minAlt from all values so that
+    // all values are zero and above
+    MapFloat shifted = val - rs.offset;
+    return shifted * rs.scale;
+}
+
+// Scales the values of map from range to 0 - 1 in a single pass
+void NormalizeRange(FloatMap* map, Range range)
+{
+    RangeScale rs = GetRangeScale(range);
+    MapFloat* data = map->data;
+
+    MapKernel(map, [&](uint32 i) { return ApplyRangeScale(rs, data[i]); });
+}
+
+// Prefer NormalizeRange when the producer can track the range
+void Normalize(FloatMap* map)
+{
+    NormalizeRange(map, GetRange(map));
+}
+
+
+// --- Map Expressions
+
+// Arithmetic on whole maps only builds up an expression, which is evaluated
+// tile by tile in one fused pass once it's assigned to a map. Chained
+// combinations don't store any intermediate maps this way.
+template <typename E>
+struct MapExpr
+{
+    E const& Self() const { return static_cast<E const&>(*this); }
+};
+
+struct MapRead : MapExpr<MapRead>
+{
+    MapFloat const* data;
+
+    explicit MapRead(MapFloat const* data) : data(data) {}
+    float64 At(uint32 i) const { return data[i]; }
+};
+
+struct MapConst : MapExpr<MapConst>
+{
+    float64 value;
+
+    explicit MapConst(float64 value) : value(value) {}
+    float64 At(uint32) const { return value; }
+};
+
+// Values computed from the tile index, for anything position dependent
+template <typename Fn>
+struct MapIndexed : MapExpr<MapIndexed<Fn>>
+{
+    Fn fn;
+
+    explicit MapIndexed(Fn fn) : fn(fn) {}
+    float64 At(uint32 i) const { return fn(i); }
+};
+
+template <typename A, typename Fn>
+struct MapUnary : MapExpr<MapUnary<A, Fn>>
+{
+    A a;
+    Fn fn;
+
+    MapUnary(A const& a, Fn fn) : a(a), fn(fn) {}
+    float64 At(uint32 i) const { return fn(a.At(i)); }
+};
+
+template <typename A, typename B, typename Op>
+struct MapBinary : MapExpr<MapBinary<A, B, Op>>
+{
+    A a;
+    B b;
+
+    MapBinary(A const& a, B const& b) : a(a), b(b) {}
+    float64 At(uint32 i) const { return Op()(a.At(i), b.At(i)); }
+};
+
+#define MAP_EXPR_OPERATOR(op, Op)                                                \
+template <typename A, typename B>                                                \
+MapBinary<A, B, Op> operator op(MapExpr<A> const& a, MapExpr<B> const& b)        \
+{                                                                                \
+    return MapBinary<A, B, Op>(a.Self(), b.Self());                              \
+}                                                                                \
+template <typename A>                                                            \
+MapBinary<A, MapConst, Op> operator op(MapExpr<A> const& a, float64 b)           \
+{                                                                                \
+    return MapBinary<A, MapConst, Op>(a.Self(), MapConst(b));                    \
+}                                                                                \
+template <typename B>                                                            \
+MapBinary<MapConst, B, Op> operator op(float64 a, MapExpr<B> const& b)           \
+{                                                                                \
+    return MapBinary<MapConst, B, Op>(MapConst(a), b.Self());                    \
+}
+
+MAP_EXPR_OPERATOR(+, std::plus<float64>)
+MAP_EXPR_OPERATOR(-, std::minus<float64>)
+MAP_EXPR_OPERATOR(*, std::multiplies<float64>)
+MAP_EXPR_OPERATOR(/, std::divides<float64>)
+
+#undef MAP_EXPR_OPERATOR
+
+inline MapRead Read(FloatMap const* map)
+{
+    return MapRead(map->data);
+}
+
+template <typename Fn>
+MapIndexed<Fn> Indexed(Fn fn)
+{
+    return MapIndexed<Fn>(fn);
+}
+
+template <typename A, typename Fn>
+MapUnary<A, Fn> Transform(MapExpr<A> const& a, Fn fn)
+{
+    return MapUnary<A, Fn>(a.Self(), fn);
+}
+
+// Reads the expression as if it had been stored and normalized with rs
+template <typename A>
+auto Scaled(MapExpr<A> const& a, RangeScale rs)
+{
+    return Transform(a, [rs](float64 val) { return ApplyRangeScale(rs, (MapFloat)val); });
+}
+
+template <typename E>
+void Assign(FloatMap* out, MapExpr<E> const& expr)
+{
+    E const& e = expr.Self();
+    MapKernel(out, [&](uint32 i) { return e.At(i); });
+}
+
+// Assigns and returns the range of what was stored
+template <typename E>
+Range AssignRange(FloatMap* out, MapExpr<E> const& expr)
+{
+    E const& e = expr.Self();
+    return MapKernelRange(out, [&](uint32 i) { return e.At(i); });
 }
 
-void GenerateNoise(FloatMap* map)
+Range GenerateNoise(FloatMap* map)
 {
-    float64* it = map->data;
-    float64* end = map->data + map->length;
+    MapFloat* it = map->data;
+    MapFloat* end = map->data + map->length;
+    Range range;
+    InitRange(&range);
 
     for (; it < end; ++it)
+    {
         *it = PWRand();
+        TrackRange(&range, *it);
+    }
+
+    return range;
 }
 
-void GenerateBinaryNoise(FloatMap* map)
+Range GenerateBinaryNoise(FloatMap* map)
 {
-    float64* it = map->data;
-    float64* end = map->data + map->length;
+    MapFloat* it = map->data;
+    MapFloat* end = map->data + map->length;
+    Range range;
+    InitRange(&range);
 
     for (; it < end; ++it)
+    {
         *it = rand() % 2;
+        TrackRange(&range, *it);
+    }
+
+    return range;
 }
 
-float64 FindThresholdFromPercent(FloatMap* map, float64 percent, bool excludeZeros)
+// Only used to notice that a map changed. Mixes in the raw bits of a whole
+// value per step, one KERNEL_BLOCK at a time so the workers can share it,
+// and then chains the block hashes in order.
+uint64 HashMapData(FloatMap const* map)
 {
-    // TODO: very small scope testing function, so this should be acceptable
-    // ideally we wouldn't allocate at all though
-    std::vector<float64> maplist;
-    maplist.resize(map->length);
-
-    // The far majority of cases shouldn't fulfill this
-    // if it is truly necessary it can be re-added, but we are in full control here
-    //if (percent >= 1.0)
-    //    return 1.01;
-    //if (percent <= 0.0)
-    //    return -0.01;
-    assert(percent >= 0.0 && percent <= 1.0);
+    MapFloat const* data = map->data;
+
+    return MapReduce<uint64>(map->length, 14695981039346656037ull,
+        [=](uint64* hash, uint32 i)
+        {
+            uint64 bits = 0;
+            memcpy(&bits, data + i, sizeof(MapFloat));
+            *hash = (*hash ^ bits) * 0x9E3779B97F4A7C15ull;
+            *hash ^= *hash >> 32;
+        },
+        [](uint64* hash, uint64 block)
+        {
+            *hash = (*hash ^ block) * 1099511628211ull;
+        });
+}
+
+// Finds the value below which each of the count percents of the map lie,
+// matching a full sort of the values. Thresholds already found for the same
+// map contents are reused instead of searched for again.
+void FindThresholdsFromPercents(FloatMap const* map, float64 const* percents, uint32 count,
+    bool excludeZeros, float64* out)
+{
+    ThresholdCache* cache = &gThrsCache;
+    uint64 hash = HashMapData(map);
+
+    if (cache->hash != hash || cache->length != map->length ||
+        cache->excludeZeros != excludeZeros)
+    {
+        cache->hash = hash;
+        cache->length = map->length;
+        cache->excludeZeros = excludeZeros;
+        cache->count = 0;
+    }
+
+    // percents that still have to be selected
+    uint32 outs[THRESHOLD_CACHE_SIZE];
+    uint32 missing = 0;
+    assert(count <= THRESHOLD_CACHE_SIZE);
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        // The far majority of cases shouldn't fulfill this
+        // if it is truly necessary it can be re-added, but we are in full control here
+        //if (percent >= 1.0)
+        //    return 1.01;
+        //if (percent <= 0.0)
+        //    return -0.01;
+        assert(percents[i] >= 0.0 && percents[i] <= 1.0);
+
+        uint32 c = 0;
+        while (c < cache->count && cache->percents[c] != percents[i])
+            ++c;
+
+        if (c < cache->count)
+            out[i] = cache->values[c];
+        else
+            outs[missing++] = i;
+    }
+
+    if (!missing)
+        return;
+
+    MapFloat* values = (MapFloat*)PoolAlloc(map->length * sizeof *values);
     uint32 size = 0;
 
     if (excludeZeros)
     {
-        float64* it = map->data;
-        float64* end = it + map->length;
-        float64* ins = maplist.data();
+        MapFloat* it = map->data;
+        MapFloat* end = it + map->length;
         for (; it < end; ++it)
             if (*it > 0.0)
-            {
-                *ins = *it;
-                ++ins;
-                ++size;
-            }
+                values[size++] = *it;
     }
     else
     {
-        memcpy(maplist.data(), map->data, map->length * sizeof(float64));
+        memcpy(values, map->data, map->length * sizeof(MapFloat));
         size = map->length;
     }
 
-    std::sort(maplist.begin(), maplist.begin() + size);
-    // storing the value locally to prevent potential issues with alloca
-    float64 retval = maplist[(uint32)(size * percent)];
-    return retval;
+    // select in ascending rank so each search only partitions what is left
+    // above the previous one
+    std::sort(outs, outs + missing, [&](uint32 a, uint32 b) { return percents[a] < percents[b]; });
+
+    MapFloat* lo = values;
+    for (uint32 m = 0; m < missing; ++m)
+    {
+        uint32 i = outs[m];
+        MapFloat* nth = values + (uint32)(size * percents[i]);
+
+        if (nth >= lo)
+        {
+            std::nth_element(lo, nth, values + size);
+            lo = nth + 1;
+        }
+
+        out[i] = *nth;
+
+        if (cache->count < THRESHOLD_CACHE_SIZE)
+        {
+            cache->percents[cache->count] = percents[i];
+            cache->values[cache->count] = out[i];
+            ++cache->count;
+        }
+    }
+
+    PoolFree(values);
+}
+
+float64 FindThresholdFromPercent(FloatMap* map, float64 percent, bool excludeZeros)
+{
+    float64 threshold;
+    FindThresholdsFromPercents(map, &percent, 1, excludeZeros, &threshold);
+    return threshold;
+}
+
+// Maps a value to bits that sort as unsigned integers in the same order
+uint64 GetOrderedBits(float64 value)
+{
+    uint64 bits;
+    memcpy(&bits, &value, sizeof bits);
+    return bits ^ ((bits >> 63) ? UINT64_MAX : 0x8000000000000000ull);
+}
+
+// Sorts the tile indices [0, count) by their key, lowest first, keeping
+// tiles with equal keys in map order. An LSD radix sort over the ordered
+// bits of the keys, skipping the bytes all keys share.
+void RadixSortTiles(MapFloat const* keys, uint32 count, uint32* out)
+{
+    uint64* bits = (uint64*)PoolAlloc(count * sizeof(uint64));
+    uint64* bitsTmp = (uint64*)PoolAlloc(count * sizeof(uint64));
+    uint32* tilesTmp = (uint32*)PoolAlloc(count * sizeof(uint32));
+    uint32 hist[8][256] = {};
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint64 b = GetOrderedBits(keys[i]);
+        bits[i] = b;
+        out[i] = i;
+        for (uint32 d = 0; d < 8; ++d)
+            ++hist[d][(b >> (d * 8)) & 0xFF];
+    }
+
+    uint64* srcBits = bits;
+    uint64* dstBits = bitsTmp;
+    uint32* srcTiles = out;
+    uint32* dstTiles = tilesTmp;
+
+    for (uint32 d = 0; d < 8 && count; ++d)
+    {
+        uint32 shift = d * 8;
+        if (hist[d][(srcBits[0] >> shift) & 0xFF] == count)
+            continue;
+
+        uint32 offsets[256];
+        uint32 sum = 0;
+        for (uint32 b = 0; b < 256; ++b)
+        {
+            offsets[b] = sum;
+            sum += hist[d][b];
+        }
+
+        for (uint32 i = 0; i < count; ++i)
+        {
+            uint32 pos = offsets[(srcBits[i] >> shift) & 0xFF]++;
+            dstBits[pos] = srcBits[i];
+            dstTiles[pos] = srcTiles[i];
+        }
+
+        std::swap(srcBits, dstBits);
+        std::swap(srcTiles, dstTiles);
+    }
+
+    if (srcTiles != out)
+        memcpy(out, srcTiles, count * sizeof(uint32));
+
+    PoolFree(tilesTmp);
+    PoolFree(bitsTmp);
+    PoolFree(bits);
+}
+
+// Sorts the tile indices of the map by their value, lowest first. Tiles with
+// equal values end up in the order std::sort has always left them in, unless
+// radixRainSort is set, which keeps them in map order.
+void SortTilesByValue(FloatMap const* map, uint32* out)
+{
+    if (gSet.radixRainSort)
+    {
+        RadixSortTiles(map->data, map->length, out);
+        return;
+    }
+
+    // std::sort only acts on the outcome of its comparisons, so sorting the
+    // indices leaves equal values in the same order as sorting the values
+    MapFloat const* keys = map->data;
+    for (uint32 i = 0; i < map->length; ++i)
+        out[i] = i;
+
+    std::sort(out, out + map->length, [=](uint32 a, uint32 b) { return keys[a] < keys[b]; });
+}
+
+void InitTileOrderCache(TileOrderCache* cache)
+{
+    cache->count = 0;
+}
+
+void ExitTileOrderCache(TileOrderCache* cache)
+{
+    for (uint32 i = 0; i < cache->count; ++i)
+        PoolFree(cache->tiles[i]);
+    cache->count = 0;
+}
+
+// Returns the tiles of the map sorted by SortTilesByValue. Maps with the
+// same contents as one sorted before share its ordering, which stays valid
+// until the cache is exited. Safe to call from several threads.
+uint32 const* GetTileOrder(TileOrderCache* cache, FloatMap const* map)
+{
+    uint64 hash = HashMapData(map);
+    std::lock_guard<std::mutex> lock(cache->lock);
+
+    for (uint32 i = 0; i < cache->count; ++i)
+        if (cache->hashes[i] == hash && cache->lengths[i] == map->length)
+            return cache->tiles[i];
+
+    assert(cache->count < TILE_ORDER_CACHE_SIZE);
+    uint32* tiles = (uint32*)PoolAlloc(map->length * sizeof(uint32));
+    SortTilesByValue(map, tiles);
+
+    cache->hashes[cache->count] = hash;
+    cache->lengths[cache->count] = map->length;
+    cache->tiles[cache->count] = tiles;
+    ++cache->count;
+    return tiles;
 }
 
-float64 GetLatitudeForY(FloatMap* map, uint16 y)
+float64 GetLatitudeForY(uint16 height, uint16 y)
 {
     int32 range = gSet.topLatitude - gSet.bottomLatitude;
-    return (y / (float64)map->dim.h) * range + gSet.bottomLatitude;
+    return (y / (float64)height) * range + gSet.bottomLatitude;
 }
 
 uint16 GetYForLatitude(FloatMap* map, float64 lat)
@@ -1575,14 +3662,8 @@ uint16 GetYForLatitude(FloatMap* map, float64 lat)
     return (uint16)floor((((lat - gSet.bottomLatitude) / range) * map->dim.h) + 0.5);
 }
 
-WindZone GetZone(FloatMap* map, uint16 y)
+WindZone GetZoneForLatitude(float64 lat)
 {
-    if (y >= map->dim.h)
-        return wNo;
-
-    // TODO: preassign values to bit fields
-    float64 lat = GetLatitudeForY(map, y);
-
     if (lat > gSet.polarFrontLatitude)
         return wNPolar;
     else if (lat >= gSet.horseLatitudes)
@@ -1597,28 +3678,6 @@ WindZone GetZone(FloatMap* map, uint16 y)
     return wSPolar;
 }
 
-uint16 GetYFromZone(FloatMap* map, WindZone zone, bool bTop)
-{
-    // TODO: pre calc these values on loading settings
-    if (bTop)
-    {
-        for (uint16 y = map->dim.h; y > 0;)
-        {
-            --y;
-            if (GetZone(map, y) == zone)
-                return y;
-        }
-    }
-    else
-    {
-        for (uint16 y = 0; y < map->dim.h; ++y)
-            if (GetZone(map, y) == zone)
-                return y;
-    }
-
-    return UINT16_MAX;
-}
-
 std::pair<Dir, Dir> GetGeostrophicWindDirections(WindZone zone)
 {
     // TODO: no pairs
@@ -1644,7 +3703,7 @@ std::pair<Dir, Dir> GetGeostrophicWindDirections(WindZone zone)
     return { dInv, dInv };
 }
 
-float64 GetGeostrophicPressure(FloatMap* map, float64 lat)
+float64 GetGeostrophicPressure(float64 lat)
 {
     float64 latRange;
     float64 latPercent;
@@ -1680,195 +3739,628 @@ float64 GetGeostrophicPressure(FloatMap* map, float64 lat)
         latPercent = (lat + gSet.polarFrontLatitude) / latRange;
         pressure = 1.0 - latPercent;
     }
-    else
+    else
+    {
+        latRange = -gSet.polarFrontLatitude + 90.0;
+        latPercent = (lat + 90) / latRange;
+        pressure = latPercent;
+    }
+
+    return pressure;
+}
+
+// --- LatitudeModel
+
+void InitLatitudeModel(LatitudeModel* model, uint16 height)
+{
+    model->height = height;
+    model->rows = (LatitudeRow*)PoolAlloc(height * sizeof(LatitudeRow));
+
+    for (uint32 w = wNo; w <= wSPolar; ++w)
+    {
+        model->zoneBottom[w] = UINT16_MAX;
+        model->zoneTop[w] = UINT16_MAX;
+    }
+
+    for (uint16 y = 0; y < height; ++y)
+    {
+        LatitudeRow* row = model->rows + y;
+        row->latitude = GetLatitudeForY(height, y);
+        row->pressure = GetGeostrophicPressure(row->latitude);
+        row->zone = GetZoneForLatitude(row->latitude);
+
+        std::pair<Dir, Dir> dir = GetGeostrophicWindDirections(row->zone);
+        row->wind = dir.first;
+        row->lateralWind = dir.second;
+
+        if (model->zoneBottom[row->zone] == UINT16_MAX)
+            model->zoneBottom[row->zone] = y;
+        model->zoneTop[row->zone] = y;
+    }
+}
+
+void ExitLatitudeModel(LatitudeModel* model)
+{
+    PoolFree(model->rows);
+    model->rows = nullptr;
+}
+
+// Gets the rows of the map, which has to be as high as the generated map
+LatitudeModel const* GetLatitudeModel(FloatMap const* map)
+{
+    assert(gLat.rows);
+    assert(gLat.height == map->dim.h);
+    return &gLat;
+}
+
+// Calls func(&value) on every tile, func is inlined unlike the old Mutator
+// function pointers
+template <typename Func>
+void ApplyFunction(FloatMap* map, Func func)
+{
+    MapFloat* data = map->data;
+
+    KernelFor(map->length, KERNEL_PARALLEL_MIN, [&](uint32 begin, uint32 end)
+    {
+        for (uint32 i = begin; i < end; ++i)
+            func(data + i);
+    });
+}
+
+// Number of tiles within rad of a hex, including itself
+inline uint32 GetHexStencilSize(uint32 rad)
+{
+    return 1 + 3 * rad * (rad + 1);
+}
+
+inline void StepHexOffset(HexOffset* ref, uint16 odd, Dir dir)
+{
+    HexOffset step = hexNeighborOffsets[(odd + ref->y) & 1][dir];
+    ref->x += step.x;
+    ref->y += step.y;
+}
+
+// Gets the offset to every tile within rad of a hex on a row of parity odd.
+// They start with the hex itself and circle outwards one ring at a time.
+uint32 GetHexStencil(uint32 rad, uint16 odd, HexOffset* out)
+{
+    static Dir const ringDirs[] = { dNE, dE, dSE, dSW, dW };
+
+    HexOffset ref = { 0, 0 };
+    HexOffset* it = out;
+    *it++ = ref;
+
+    // make a circle for each radius
+    for (uint32 r = 0; r < rad; ++r)
+    {
+        // start 1 to the west
+        StepHexOffset(&ref, odd, dW);
+        *it++ = ref;
+
+        // Go r times in each direction around the circle
+        for (Dir dir : ringDirs)
+            for (uint32 z = 0; z <= r; ++z)
+            {
+                StepHexOffset(&ref, odd, dir);
+                *it++ = ref;
+            }
+
+        // Go r - 1 times to the NW
+        for (uint32 z = 0; z < r; ++z)
+        {
+            StepHexOffset(&ref, odd, dNW);
+            *it++ = ref;
+        }
+
+        // one extra NW to set up for next circle
+        StepHexOffset(&ref, odd, dNW);
+    }
+
+    assert(it - out == GetHexStencilSize(rad));
+    return it - out;
+}
+
+// Builds the stencils of every radius up to maxRadius once per generation.
+// Since they are stored one ring at a time, the stencil of any smaller
+// radius is the start of the larger one.
+void InitHexStencils(uint32 maxRadius)
+{
+    uint32 size = GetHexStencilSize(maxRadius);
+
+    for (uint16 odd = 0; odd < 2; ++odd)
+    {
+        gHexStencils[odd] = (HexOffset*)PoolAlloc(size * sizeof(HexOffset));
+        GetHexStencil(maxRadius, odd, gHexStencils[odd]);
+    }
+
+    gHexStencilRadius = maxRadius;
+}
+
+void ExitHexStencils()
+{
+    PoolFree(gHexStencils[0]);
+    PoolFree(gHexStencils[1]);
+    gHexStencils[0] = gHexStencils[1] = NULL;
+    gHexStencilRadius = 0;
+}
+
+inline HexOffset const* GetCachedHexStencil(uint32 rad, uint16 odd)
+{
+    assert(rad <= gHexStencilRadius);
+    return gHexStencils[odd & 1];
+}
+
+// Calls func(i) for every tile within rad of c that is on the map, wrapping
+// the same way GetIndex does
+template <typename Func>
+void ForEachInHex(FloatMap const* map, Coord c, uint32 rad, Func func)
+{
+    HexOffset const* it = GetCachedHexStencil(rad, c.y % 2);
+    HexOffset const* end = it + GetHexStencilSize(rad);
+
+    // nothing can wrap or fall off the map away from the edges
+    if (c.x >= rad && c.x + rad < map->dim.w &&
+        c.y >= rad && c.y + rad < map->dim.h)
+    {
+        int32 i = c.y * map->dim.w + c.x;
+        for (; it < end; ++it)
+            func((uint32)(i + it->y * map->dim.w + it->x));
+        return;
+    }
+
+    // coordinates off the west and south edges underflow the same way
+    // GetNeighbor steps do
+    for (; it < end; ++it)
     {
-        latRange = -gSet.polarFrontLatitude + 90.0;
-        latPercent = (lat + 90) / latRange;
-        pressure = latPercent;
+        Coord n = { (uint16)(c.x + it->x), (uint16)(c.y + it->y) };
+        uint32 i = GetIndex(map, n);
+        if (i < map->length)
+            func(i);
     }
+}
 
-    return pressure;
+// Calls func(i) for every tile within rad of c, excluding c itself. Never
+// wraps, tiles past any edge are skipped
+template <typename Func>
+void ForEachAroundCell(Dim dim, Coord c, uint32 rad, Func func)
+{
+    HexOffset const* it = GetCachedHexStencil(rad, c.y % 2);
+    HexOffset const* end = it + GetHexStencilSize(rad);
+
+    for (++it; it < end; ++it)
+    {
+        Coord n = { (uint16)(c.x + it->x), (uint16)(c.y + it->y) };
+        if (n.x < dim.w && n.y < dim.h)
+            func((uint32)n.y * dim.w + n.x);
+    }
 }
 
-typedef void (*Mutator)(float64 *);
+// Calls func(i) for every tile exactly rad from c, starting and ending on the
+// tile rad to the west. Never wraps, tiles past any edge are skipped
+template <typename Func>
+void ForEachOnRing(Dim dim, Coord c, uint32 rad, Func func)
+{
+    HexOffset const* stencil = GetCachedHexStencil(rad, c.y % 2);
+    HexOffset const* it = stencil + (rad ? GetHexStencilSize(rad - 1) : 0);
+    HexOffset const* end = stencil + GetHexStencilSize(rad);
+
+    auto visit = [&](HexOffset const* off)
+    {
+        Coord n = { (uint16)(c.x + off->x), (uint16)(c.y + off->y) };
+        if (n.x < dim.w && n.y < dim.h)
+            func((uint32)n.y * dim.w + n.x);
+    };
+
+    for (HexOffset const* o = it; o < end; ++o)
+        visit(o);
+
+    // TODO: remove, temporarily recreating bug in original program
+    if (rad)
+        visit(it);
+}
 
-void ApplyFunction(FloatMap* map, Mutator func)
+float64 GetAverageInHex(FloatMap* map, Coord c, uint32 rad)
 {
-    float64* it = map->data;
-    float64* end = it + map->length;
+    float64 avg = 0.0;
+    uint32 size = 0;
 
-    for (; it < end; ++it)
-        func(it);
+    ForEachInHex(map, c, rad, [&](uint32 i)
+    {
+        avg += map->data[i];
+        ++size;
+    });
+
+    return avg / size;
 }
 
-uint32 GetRadiusAroundHex(FloatMap* map, Coord c, uint32 rad, Coord ** out)
+float64 GetStdDevInHex(FloatMap* map, Coord c, uint32 rad)
 {
-    uint32 binCoef = (rad * (rad + 1)) / 2;
-    uint32 maxTiles = 1 + 6 * binCoef;
-    Coord* coords = (Coord*)calloc(maxTiles, sizeof(Coord));
-    *coords = c;
+    float64 avg = 0.0;
+    uint32 size = 0;
 
-    Coord ref = c;
-    Coord* it = coords + 1;
+    ForEachInHex(map, c, rad, [&](uint32 i)
+    {
+        avg += map->data[i];
+        ++size;
+    });
 
-    // make a circle for each radius
-    for (uint32 r = 0; r < rad; ++r)
+    avg /= size;
+
+    float64 deviation = 0.0;
+    ForEachInHex(map, c, rad, [&](uint32 i)
     {
-        // start 1 to the west
-        GetNeighbor(map, ref, dW, it);
-        ref = *it;
+        float64 sqr = map->data[i] - avg;
+        deviation += sqr * sqr;
+    });
 
-        if (IsOnMap(map, ref))
-            ++it;
+    return sqrt(deviation / size);
+}
 
-        // Go r times to the NE
-        for (uint32 z = 0; z <= r; ++z)
-        {
-            GetNeighbor(map, ref, dNE, it);
-            ref = *it;
+// Prefix sums of a padded map along rows and both hex diagonals, so any run
+// of tiles along one of the three hex axes sums in O(1)
+template <typename T>
+struct HexLineSums
+{
+    T* row; // from the west edge of the padded map
+    T* ne;  // from the bottom of its SW to NE diagonal
+    T* nw;  // from the bottom of its SE to NW diagonal
+};
 
-            if (IsOnMap(map, ref))
-                ++it;
-        }
+// x of axial coordinate q on row y, odd rows are shifted half a hex east
+inline int32 GetOffsetX(int32 q, int32 y)
+{
+    return q + ((y - (y & 1)) / 2);
+}
 
-        // Go r times to the E
-        for (uint32 z = 0; z <= r; ++z)
-        {
-            GetNeighbor(map, ref, dE, it);
-            ref = *it;
+template <typename T, typename S>
+void InitHexLineSums(HexLineSums<S>* sums, PaddedMapT<T> const* map)
+{
+    int32 halo = map->halo;
+    int32 stride = map->stride;
+    int32 w = map->dim.w;
+    int32 h = map->dim.h;
+    uint32 size = stride * (h + 2 * halo);
 
-            if (IsOnMap(map, ref))
-                ++it;
-        }
+    sums->row = (S*)PoolAlloc(size * 3 * sizeof(S));
+    sums->ne = sums->row + size;
+    sums->nw = sums->ne + size;
 
-        // Go r times to the SE
-        for (uint32 z = 0; z <= r; ++z)
-        {
-            GetNeighbor(map, ref, dSE, it);
-            ref = *it;
+    T const* src = map->storage;
+    uint32 i = 0;
+    for (int32 y = -halo; y < h + halo; ++y)
+    {
+        // SW and SE neighbors on the row below
+        int32 swX = y & 1 ? 0 : -1;
+        int32 seX = y & 1 ? 1 : 0;
 
-            if (IsOnMap(map, ref))
-                ++it;
+        for (int32 x = -halo; x < w + halo; ++x, ++i)
+        {
+            S v = src[i];
+            bool below = y > -halo;
+            sums->row[i] = v + (x > -halo ? sums->row[i - 1] : 0);
+            sums->ne[i] = v + (below && x + swX >= -halo ? sums->ne[i - stride + swX] : 0);
+            sums->nw[i] = v + (below && x + seX < w + halo ? sums->nw[i - stride + seX] : 0);
         }
+    }
+}
 
-        // Go r times to the SW
-        for (uint32 z = 0; z <= r; ++z)
-        {
-            GetNeighbor(map, ref, dSW, it);
-            ref = *it;
+template <typename S>
+void ExitHexLineSums(HexLineSums<S>* sums)
+{
+    PoolFree(sums->row);
+}
 
-            if (IsOnMap(map, ref))
-                ++it;
-        }
+// Slides a hex of radius rad along every row of map. Moving one tile east
+// adds the two east edges of the new hex and drops the two west edges of the
+// old one, each of which is a run along a hex diagonal, so the cost per
+// tile doesn't depend on rad. fn(i, sum) is called for every tile in order.
+// map's halo must be at least rad + 2.
+template <typename T, typename S, typename Fn>
+void SlideHexSums(PaddedMapT<T> const* map, HexLineSums<S> const* sums, int32 rad, Fn fn)
+{
+    assert(map->halo >= rad + 2);
 
-        // Go r times to the W
-        for (uint32 z = 0; z <= r; ++z)
-        {
-            GetNeighbor(map, ref, dW, it);
-            ref = *it;
+    int32 w = map->dim.w;
+    int32 h = map->dim.h;
+    int32 stride = map->stride;
+    // index into the line sums of tile x, y
+    int32 origin = map->halo * stride + map->halo;
+    auto at = [&](S const* line, int32 q, int32 y)
+    {
+        int32 x = GetOffsetX(q, y);
+        return line[origin + y * stride + x];
+    };
 
-            if (IsOnMap(map, ref))
-                ++it;
+    uint32 i = 0;
+    for (int32 y = 0; y < h; ++y)
+    {
+        // axial q of x = 0
+        int32 q = -((y - (y & 1)) / 2);
+
+        // the first hex on the row is summed a row of the hex at a time
+        S sum = 0;
+        for (int32 b = -rad; b <= rad; ++b)
+        {
+            int32 lo = std::max(-rad, -rad - b);
+            int32 hi = std::min(rad, rad - b);
+            sum += at(sums->row, q + hi, y + b);
+            if (GetOffsetX(q + lo, y + b) > -map->halo)
+                sum -= at(sums->row, q + lo - 1, y + b);
         }
 
-        // Go r - 1 times to the NW
-        if (r)
-            for (uint32 z = 0; z <= r - 1; ++z)
-            {
-                GetNeighbor(map, ref, dNW, it);
-                ref = *it;
+        for (int32 x = 0; x < w; ++x, ++q, ++i)
+        {
+            fn(i, sum);
+
+            // tiles a = rad + 1 from q for b in [-rad, 0]
+            sum += at(sums->ne, q + rad + 1, y) - at(sums->ne, q + rad + 1, y - rad - 1);
+            // tiles a + b = rad + 1 for b in [1, rad]
+            sum += at(sums->nw, q + 1, y + rad) - at(sums->nw, q + rad + 1, y);
+            // tiles a = -rad for b in [0, rad]
+            sum -= at(sums->ne, q - rad, y + rad) - at(sums->ne, q - rad, y - 1);
+            // tiles a + b = -rad for b in [-rad, -1]
+            sum -= at(sums->nw, q - rad + 1, y - 1) - at(sums->nw, q + 1, y - rad - 1);
+        }
+    }
+}
 
-                if (IsOnMap(map, ref))
-                    ++it;
-            }
+// Gets the index deltas of the rad stencil for even and odd rows of a padded
+// map with rows stride apart
+void GetPaddedStencils(uint32 stride, uint32 rad, int32* deltas[2])
+{
+    uint32 size = GetHexStencilSize(rad);
+    HexOffset* stencil = (HexOffset*)PoolAlloc(size * sizeof *stencil);
 
-        // one extra NW to set up for next circle
-        GetNeighbor(map, ref, dNW, &ref);
+    for (uint16 odd = 0; odd < 2; ++odd)
+    {
+        GetHexStencil(rad, odd, stencil);
+        for (uint32 i = 0; i < size; ++i)
+            deltas[odd][i] = stencil[i].y * (int32)stride + stencil[i].x;
     }
 
-    *out = coords;
-    return it - coords;
+    PoolFree(stencil);
 }
 
-float64 GetAverageInHex(FloatMap* map, Coord c, uint32 rad)
+// Calls fn(out, src, mask, d, size) for every tile, where src and mask point
+// at the tile on padded and onMap and d holds the stencil deltas for its
+// row. Rows are split across the workers.
+template <typename Fn>
+void WalkPaddedHexes(PaddedMap const* padded, PaddedMapT<uint8> const* onMap, uint32 rad,
+    MapFloat* out, Fn fn)
 {
-    Coord* refCoords = NULL;
-    uint32 size = GetRadiusAroundHex(map, c, rad, &refCoords);
-    float64 avg = 0.0;
+    uint32 w = padded->dim.w;
+    uint32 size = GetHexStencilSize(rad);
+    int32* deltas[2];
+    deltas[0] = (int32*)PoolAlloc(size * 2 * sizeof(int32));
+    deltas[1] = deltas[0] + size;
+    GetPaddedStencils(padded->stride, rad, deltas);
 
-    Coord* end = refCoords + size;
-    for (Coord* it = refCoords; it < end; ++it)
+    ParallelFor(padded->dim.h, [&](uint32 begin, uint32 end)
     {
-        uint32 i = GetIndex(map, *it);
-        avg += map->data[i];
-    }
+        for (uint32 y = begin; y < end; ++y)
+        {
+            int32 const* d = deltas[y % 2];
+            for (uint32 x = 0; x < w; ++x)
+            {
+                uint32 base = y * padded->stride + x;
+                fn(out + y * w + x, padded->data + base, onMap->data + base, d, size);
+            }
+        }
+    });
 
-    free(refCoords);
-    return avg / size;
+    PoolFree(deltas[0]);
 }
 
-float64 GetStdDevInHex(FloatMap* map, Coord c, uint32 rad)
+// Same as GetAverageInHex on every tile, adding up each hex in the same
+// order. The halos add zero for tiles off the map, and onMap counts how many
+// tiles were actually on it.
+void SmoothByHex(FloatMap const* map, uint32 rad, MapFloat* out, Range* range)
 {
-    Coord* refCoords = NULL;
-    uint32 size = GetRadiusAroundHex(map, c, rad, &refCoords);
-    float64 avg = 0.0;
+    PaddedMap padded;
+    InitPaddedMap(&padded, map->dim, map->wrapX, map->wrapY, rad);
+    CopyToPaddedMap(map, &padded);
+    PaddedMapT<uint8> onMap;
+    InitOnMapMask(&onMap, map->dim, map->wrapX, map->wrapY, rad);
 
-    Coord* end = refCoords + size;
-    for (Coord* it = refCoords; it < end; ++it)
+    WalkPaddedHexes(&padded, &onMap, rad, out, [](MapFloat* it, MapFloat const* src,
+        uint8 const* mask, int32 const* d, uint32 size)
     {
-        uint32 i = GetIndex(map, *it);
-        avg += map->data[i];
-    }
+        float64 avg = 0.0;
+        uint32 count = 0;
+        for (uint32 i = 0; i < size; ++i)
+        {
+            avg += src[d[i]];
+            count += mask[d[i]];
+        }
 
-    avg /= size;
+        *it = avg / count;
+    });
+    TrackRange(range, out, map->length);
 
-    float64 deviation = 0.0;
-    for (Coord* it = refCoords; it < end; ++it)
+    ExitPaddedMap(&onMap);
+    ExitPaddedMap(&padded);
+}
+
+// Same as SmoothByHex, but from sliding hex sums, see SlideHexSums
+void SmoothBySums(FloatMap const* map, uint32 rad, MapFloat* out, Range* range)
+{
+    uint16 halo = rad + 2;
+    PaddedMap padded;
+    InitPaddedMap(&padded, map->dim, map->wrapX, map->wrapY, halo);
+    CopyToPaddedMap(map, &padded);
+    HexLineSums<float64> valueSums;
+    InitHexLineSums(&valueSums, &padded);
+
+    PaddedMapT<uint8> onMap;
+    InitOnMapMask(&onMap, map->dim, map->wrapX, map->wrapY, halo);
+    HexLineSums<int32> countSums;
+    InitHexLineSums(&countSums, &onMap);
+
+    int32* counts = (int32*)PoolAlloc(map->length * sizeof *counts);
+    SlideHexSums(&onMap, &countSums, rad, [&](uint32 i, int32 count)
     {
-        uint32 i = GetIndex(map, *it);
-        float64 sqr = map->data[i] - avg;
-        deviation += sqr * sqr;
-    }
+        counts[i] = count;
+    });
+    SlideHexSums(&padded, &valueSums, rad, [&](uint32 i, float64 sum)
+    {
+        out[i] = sum / counts[i];
+        TrackRange(range, out[i]);
+    });
 
-    free(refCoords);
-    return sqrt(deviation / size);
+    PoolFree(counts);
+    ExitHexLineSums(&countSums);
+    ExitPaddedMap(&onMap);
+    ExitHexLineSums(&valueSums);
+    ExitPaddedMap(&padded);
 }
 
-// TODO: this needs MASSIVE optimization
-void Smooth(FloatMap* map, uint32 rad)
+// Averages every tile with the tiles within rad of it, like GetAverageInHex.
+// Tiles past an edge that doesn't wrap are left out of the average. With
+// slidingHexSums the cost no longer depends on rad, but differences of line
+// sums don't round the same as adding up each hex, so existing seeds change.
+Range Smooth(FloatMap* map, uint32 rad)
 {
-    float64* smoothedData = (float64*)malloc(map->length * sizeof *smoothedData);
+    MapFloat* smoothedData = (MapFloat*)PoolAlloc(map->length * sizeof *smoothedData);
+    Range range;
+    InitRange(&range);
 
-    float64* it = smoothedData;
-    Coord c;
-    for (c.y = 0; c.y < map->dim.h; ++c.y)
-        for (c.x = 0; c.x < map->dim.w; ++c.x, ++it)
-            *it = GetAverageInHex(map, c, rad);
+    if (gSet.slidingHexSums)
+        SmoothBySums(map, rad, smoothedData, &range);
+    else
+        SmoothByHex(map, rad, smoothedData, &range);
 
-    float64* old = map->data;
+    MapFloat* old = map->data;
     map->data = smoothedData;
-    free(old);
+    PoolFree(old);
+
+    return range;
 }
 
-// TODO: this needs MASSIVE optimization
-void Deviate(FloatMap* map, uint32 rad)
+// Same as GetStdDevInHex on every tile, see SmoothByHex
+void DeviateByHex(FloatMap const* map, uint32 rad, MapFloat* out, Range* range)
 {
-    float64* deviatedData = (float64*)malloc(map->length * sizeof *deviatedData);
+    PaddedMap padded;
+    InitPaddedMap(&padded, map->dim, map->wrapX, map->wrapY, rad);
+    CopyToPaddedMap(map, &padded);
+    PaddedMapT<uint8> onMap;
+    InitOnMapMask(&onMap, map->dim, map->wrapX, map->wrapY, rad);
 
-    float64* it = deviatedData;
-    Coord c;
-    for (c.y = 0; c.y < map->dim.h; ++c.y)
-        for (c.x = 0; c.x < map->dim.w; ++c.x, ++it)
-            *it = GetStdDevInHex(map, c, rad);
+    WalkPaddedHexes(&padded, &onMap, rad, out, [](MapFloat* it, MapFloat const* src,
+        uint8 const* mask, int32 const* d, uint32 size)
+    {
+        float64 avg = 0.0;
+        uint32 count = 0;
+        for (uint32 i = 0; i < size; ++i)
+        {
+            avg += src[d[i]];
+            count += mask[d[i]];
+        }
+
+        avg /= count;
+
+        // tiles off the map are masked out of the deviation
+        float64 deviation = 0.0;
+        for (uint32 i = 0; i < size; ++i)
+        {
+            float64 sqr = src[d[i]] - avg;
+            deviation += sqr * sqr * mask[d[i]];
+        }
 
-    assert(it - deviatedData == map->length);
-    float64* old = map->data;
+        *it = sqrt(deviation / count);
+    });
+    TrackRange(range, out, map->length);
+
+    ExitPaddedMap(&onMap);
+    ExitPaddedMap(&padded);
+}
+
+// Same as DeviateByHex, but from sliding hex sums of x and x^2 the same way
+// SmoothBySums works. The values are shifted by the map's mean first so the
+// sums stay small and the variance doesn't cancel away when the map has a
+// large offset.
+void DeviateBySums(FloatMap const* map, uint32 rad, MapFloat* out, Range* range)
+{
+    float64 mean = 0.0;
+    for (uint32 i = 0; i < map->length; ++i)
+        mean += map->data[i];
+    mean /= map->length;
+
+    uint16 halo = rad + 2;
+    PaddedMapT<float64> shifted;
+    InitPaddedMap(&shifted, map->dim, map->wrapX, map->wrapY, halo);
+    for (uint32 y = 0; y < map->dim.h; ++y)
+        for (uint32 x = 0; x < map->dim.w; ++x)
+            shifted.data[y * shifted.stride + x] = map->data[y * map->dim.w + x] - mean;
+    RefreshHalo(&shifted);
+
+    // the halos past edges that don't wrap are still zero once squared
+    PaddedMapT<float64> squared;
+    InitPaddedMap(&squared, map->dim, map->wrapX, map->wrapY, halo);
+    uint32 storageSize = shifted.stride * (map->dim.h + 2 * halo);
+    for (uint32 i = 0; i < storageSize; ++i)
+        squared.storage[i] = shifted.storage[i] * shifted.storage[i];
+
+    PaddedMapT<uint8> onMap;
+    InitOnMapMask(&onMap, map->dim, map->wrapX, map->wrapY, halo);
+
+    int32* counts = (int32*)PoolAlloc(map->length * sizeof *counts);
+    float64* means = (float64*)PoolAlloc(map->length * sizeof *means);
+
+    HexLineSums<int32> countSums;
+    InitHexLineSums(&countSums, &onMap);
+    SlideHexSums(&onMap, &countSums, rad, [&](uint32 i, int32 count)
+    {
+        counts[i] = count;
+    });
+    ExitHexLineSums(&countSums);
+
+    HexLineSums<float64> sums;
+    InitHexLineSums(&sums, &shifted);
+    SlideHexSums(&shifted, &sums, rad, [&](uint32 i, float64 sum)
+    {
+        means[i] = sum / counts[i];
+    });
+    ExitHexLineSums(&sums);
+
+    InitHexLineSums(&sums, &squared);
+    SlideHexSums(&squared, &sums, rad, [&](uint32 i, float64 sum)
+    {
+        float64 variance = sum / counts[i] - means[i] * means[i];
+        out[i] = sqrt(std::max(variance, 0.0));
+        TrackRange(range, out[i]);
+    });
+    ExitHexLineSums(&sums);
+
+    PoolFree(means);
+    PoolFree(counts);
+    ExitPaddedMap(&onMap);
+    ExitPaddedMap(&squared);
+    ExitPaddedMap(&shifted);
+}
+
+// Standard deviation of every tile and the tiles within rad of it, like
+// GetStdDevInHex. slidingHexSums trades the exact two pass deviation for
+// one that doesn't depend on rad, which changes existing seeds.
+Range Deviate(FloatMap* map, uint32 rad)
+{
+    MapFloat* deviatedData = (MapFloat*)PoolAlloc(map->length * sizeof *deviatedData);
+    Range range;
+    InitRange(&range);
+
+    if (gSet.slidingHexSums)
+        DeviateBySums(map, rad, deviatedData, &range);
+    else
+        DeviateByHex(map, rad, deviatedData, &range);
+
+    MapFloat* old = map->data;
     map->data = deviatedData;
-    free(old);
+    PoolFree(old);
+
+    return range;
 }
 
 // TODO: obviate the need for such a function
-bool IsOnMap(FloatMap* map, Coord c)
+bool IsOnMap(FloatMap const* map, Coord c)
 {
     uint32 i = GetIndex(map, c);
 
@@ -1883,8 +4375,8 @@ void Save(FloatMap* map)
 
     if (fp)
     {
-        float64* it = map->data;
-        float64* end = it + map->length;
+        MapFloat* it = map->data;
+        MapFloat* end = it + map->length;
 
         for (; it < end; ++it)
             fprintf(fp, "%lf,", *it);
@@ -1926,13 +4418,13 @@ void InitPWAreaMap(PWAreaMap* map, Dim dim, bool xWrap, bool yWrap)
 void ExitPWAreaMap(PWAreaMap* map)
 {
     if (map->areaList)
-        free(map->areaList);
+        PoolFree(map->areaList);
     ExitFloatMap(&map->base);
 }
 
 void Clear(PWAreaMap* map)
 {
-    memset(map->base.data, 0, map->base.length * sizeof(float64));
+    memset(map->base.data, 0, map->base.length * sizeof(MapFloat));
 }
 
 void DefineAreas(PWAreaMap* map, MatchI mFunc, bool bDebug)
@@ -1940,8 +4432,8 @@ void DefineAreas(PWAreaMap* map, MatchI mFunc, bool bDebug)
     Clear(map);
 
     if (map->areaList)
-        free(map->areaList);
-    map->areaList = (PWArea*)malloc(map->base.length * sizeof(PWArea));
+        PoolFree(map->areaList);
+    map->areaList = (PWArea*)PoolCalloc(map->base.length, sizeof(PWArea));
 
     uint32 currentAreaID = 0;
     Coord c;
@@ -2174,8 +4666,8 @@ void InitLineSeg(LineSeg* seg, int16 y, int16 xLeft, int16 xRight, int16 dy)
 void InitRiverMap(RiverMap* map, ElevationMap * elevMap)
 {
     map->eMap = elevMap;
-    map->riverData = (RiverHex*)malloc(elevMap->base.length * sizeof(RiverHex));
-    map->rivers = (River*)malloc(elevMap->base.length * 2 * sizeof(River));
+    map->riverData = (RiverHex*)PoolCalloc(elevMap->base.length, sizeof(RiverHex));
+    map->rivers = (River*)PoolCalloc(elevMap->base.length * 2, sizeof(River));
     map->riverCnt = 0;
     map->riverThreshold = 0.0;
 
@@ -2281,7 +4773,7 @@ uint8 GetJunctionsAroundHex(RiverMap* map, RiverHex* hex, RiverJunction* out[6])
 void SetJunctionAltitudes(RiverMap* map)
 {
     Coord c;
-    float64* elevIt = map->eMap->base.data;
+    MapFloat* elevIt = map->eMap->base.data;
     RiverHex* rivIt = map->riverData;
 
     // TODO: iterative
@@ -2398,10 +4890,10 @@ float64 GetNeighborAverage(RiverMap* map, RiverJunction* junc)
 void SiltifyLakes(RiverMap* map)
 {
     uint32 cap = map->eMap->base.length * 2;
-    RiverJunction** lakeList = (RiverJunction**)malloc(cap * sizeof(void*));
+    RiverJunction** lakeList = (RiverJunction**)PoolCalloc(cap, sizeof(void*));
     RiverJunction** lakeListEnd = lakeList + cap;
-    bool* onQueueMapNorth = (bool*)malloc(map->eMap->base.length * sizeof(bool));
-    bool* onQueueMapSouth = (bool*)malloc(map->eMap->base.length * sizeof(bool));
+    bool* onQueueMapNorth = (bool*)PoolCalloc(map->eMap->base.length, sizeof(bool));
+    bool* onQueueMapSouth = (bool*)PoolCalloc(map->eMap->base.length, sizeof(bool));
 
     RiverHex* it = map->riverData;
     RiverHex* end = it + map->eMap->base.length;
@@ -2483,27 +4975,27 @@ void SiltifyLakes(RiverMap* map)
         }
     }
 
-    free(onQueueMapSouth);
-    free(onQueueMapNorth);
-    free(lakeList);
+    PoolFree(onQueueMapSouth);
+    PoolFree(onQueueMapNorth);
+    PoolFree(lakeList);
 
     printf("Siltified Lakes over %d iterations. - Brought to you by Bobert13\n", iter);
 }
 
-void RecreateNewLakes(RiverMap* map, float64* rainfallMap)
+void RecreateNewLakes(RiverMap* map, MapFloat* rainfallMap)
 {
     LakeDataUtil ldu;
     ldu.lakesToAdd = (uint32)(map->eMap->base.length * gSet.landPercent * gSet.lakePercent);
     ldu.lakesAdded = 0;
     ldu.currentLakeID = 1;
 
-    RiverHex** riverHexList = (RiverHex **)malloc(map->eMap->base.length * sizeof(void*));
+    RiverHex** riverHexList = (RiverHex **)PoolCalloc(map->eMap->base.length, sizeof(void*));
     RiverHex** riverHexIns = riverHexList;
 
-    float64* it = map->eMap->base.data;
-    float64* end = it + map->eMap->base.length;
+    MapFloat* it = map->eMap->base.data;
+    MapFloat* end = it + map->eMap->base.length;
     RiverHex* rivIt = map->riverData;
-    float64* rainIt = rainfallMap;
+    MapFloat* rainIt = rainfallMap;
 
     riverRef = map->riverData;
     AddVerts(map->riverData, sizeof * map->riverData, StampVertAltitude);
@@ -2578,7 +5070,7 @@ void RecreateNewLakes(RiverMap* map, float64* rainfallMap)
         }
     }
 
-    free(riverHexList);
+    PoolFree(riverHexList);
 }
 
 void GrowLake(RiverMap* map, RiverHex * lakeHex, uint32 lakeSize, LakeDataUtil* ldu,
@@ -2596,14 +5088,13 @@ void GrowLake(RiverMap* map, RiverHex * lakeHex, uint32 lakeSize, LakeDataUtil*
     lakeList.push_back(lakeHex);
 
     // choose random neighbors to put on queue
-    std::vector<uint32> neighbors = GetRadiusAroundCell(map->eMap->base.dim, lakeHex->coord, 1);
-    for (uint32 ind : neighbors)
+    ForEachAroundCell(map->eMap->base.dim, lakeHex->coord, 1, [&](uint32 ind)
     {
         RiverHex* neighbor = map->riverData + ind;
         if (ValidLakeHex(map, neighbor, ldu) &&
             PWRandInt(1, 3) == 1)
             growthQueue.push_back(neighbor);
-    }
+    });
 }
 
 RiverJunction* GetLowestJunctionAroundHex(RiverMap* map, RiverHex * lakeHex)
@@ -2661,19 +5152,19 @@ bool ValidLakeHex(RiverMap* map, RiverHex* lakeHex, LakeDataUtil* ldu)
     if (plot->feature != fNONE)
         return false;
 
-    std::vector<uint32> cellList = GetRadiusAroundCell(map->eMap->base.dim, lakeHex->coord, 1);
-    for (uint32 i : cellList)
+    bool valid = true;
+    ForEachAroundCell(map->eMap->base.dim, lakeHex->coord, 1, [&](uint32 i)
     {
         RiverHex* nHex = map->riverData + i;
 
         if (map->eMap->base.data[i] < map->eMap->seaThreshold)
-            return false;
+            valid = false;
         else if (nHex->lakeID != UINT32_MAX && nHex->lakeID != ldu->currentLakeID)
-            return false;
-    }
+            valid = false;
+    });
 
     // assume true until problem occurs
-    return true;
+    return valid;
 }
 
 RiverHex* GetInitialLake(RiverMap* map, RiverJunction* junc, FlowDir prospectiveFlow)
@@ -2696,7 +5187,7 @@ RiverHex* GetInitialLake(RiverMap* map, RiverJunction* junc, FlowDir prospective
 static uint32 GetJuncData(RiverMap* map, RiverJunction*** out)
 {
     uint32 juncListLen = map->eMap->base.length * 2;
-    *out = (RiverJunction**)malloc(juncListLen * sizeof(void*));
+    *out = (RiverJunction**)PoolCalloc(juncListLen, sizeof(void*));
     RiverHex* it = map->riverData;
     RiverHex* end = it + map->eMap->base.length;
     RiverJunction** juncIns = *out;
@@ -2744,7 +5235,7 @@ void SetFlowDestinations(RiverMap* map)
         }
     }
 
-    free(junctionList);
+    PoolFree(junctionList);
 
     printf("validFlowCount = %d\n", validFlowCount);
 }
@@ -2785,7 +5276,7 @@ bool IsTouchingOcean(RiverMap* map, RiverJunction* junc)
 static uint32 GetFilteredJuncData(RiverMap* map, RiverJunction*** out)
 {
     uint32 juncListLen = map->eMap->base.length * 2;
-    *out = (RiverJunction**)malloc(juncListLen * sizeof(void*));
+    *out = (RiverJunction**)PoolCalloc(juncListLen, sizeof(void*));
     RiverHex* it = map->riverData;
     RiverHex* end = it + map->eMap->base.length;
     RiverJunction** juncIns = *out;
@@ -2806,7 +5297,7 @@ static uint32 GetFilteredJuncData(RiverMap* map, RiverJunction*** out)
     return (uint32)(juncIns - *out);
 }
 
-void SetRiverSizes(RiverMap* map, float64 * locRainfallMap)
+void SetRiverSizes(RiverMap* map, MapFloat * locRainfallMap)
 {
     // only include junctions not touching ocean in this list
     RiverJunction** junctionList = nullptr;
@@ -2861,7 +5352,7 @@ void SetRiverSizes(RiverMap* map, float64 * locRainfallMap)
     map->riverThreshold = junctionList[riverIndex]->size;
     printf("river threshold = %f\n", map->riverThreshold);
 
-    free(junctionList);
+    PoolFree(junctionList);
 }
 
 RiverJunction* GetNextJunctionInFlow(RiverMap* map, RiverJunction* junc)
@@ -3059,9 +5550,8 @@ FlowDirRet GetFlowDirections(RiverMap* map, Coord c)
     TileFlowDirection WOfRiver = tfdNO_FLOW;
     uint32 WID = UINT32_MAX;
 
-    Coord coord;
-    GetNeighbor(&map->eMap->base, c, dNE, &coord);
-    uint32 ii = GetIndex(&map->eMap->base, coord);
+    HexTopology const* topo = GetHexTopology(&map->eMap->base);
+    uint32 ii = GetNeighborIndex(topo, i, dNE);
 
     if (ii != UINT32_MAX &&
         map->riverData[ii].southJunction.flow == fdVert &&
@@ -3072,8 +5562,7 @@ FlowDirRet GetFlowDirections(RiverMap* map, Coord c)
         WID = map->riverData[ii].southJunction.id;
     }
 
-    GetNeighbor(&map->eMap->base, c, dSE, &coord);
-    ii = GetIndex(&map->eMap->base, coord);
+    ii = GetNeighborIndex(topo, i, dSE);
 
     if (ii != UINT32_MAX &&
         map->riverData[ii].northJunction.flow == fdVert &&
@@ -3088,8 +5577,7 @@ FlowDirRet GetFlowDirections(RiverMap* map, Coord c)
     TileFlowDirection NWOfRiver = tfdNO_FLOW;
     uint32 NWID = UINT32_MAX;
 
-    GetNeighbor(&map->eMap->base, c, dSE, &coord);
-    ii = GetIndex(&map->eMap->base, coord);
+    ii = GetNeighborIndex(topo, i, dSE);
 
     if (ii != UINT32_MAX &&
         map->riverData[ii].northJunction.flow == fdWest &&
@@ -3112,8 +5600,7 @@ FlowDirRet GetFlowDirections(RiverMap* map, Coord c)
     TileFlowDirection NEOfRiver = tfdNO_FLOW;
     uint32 NEID = UINT32_MAX;
 
-    GetNeighbor(&map->eMap->base, c, dSW, &coord);
-    ii = GetIndex(&map->eMap->base, coord);
+    ii = GetNeighborIndex(topo, i, dSW);
 
     if (ii != UINT32_MAX &&
         map->riverData[ii].northJunction.flow == fdEast &&
@@ -3245,6 +5732,69 @@ uint32 CountLand(uint32 len, uint8* plotTypes, uint8* terrainTypes)
     return landCount;
 }
 
+// float64 builds save their plot and terrain types as a reference for the
+// seed and map size, which PW6_FLOAT32 builds then compare themselves against
+void ReportPrecision(Dim dim, uint8* plotTypes, uint8* terrainTypes)
+{
+    if (gSet.fixedSeed == 0)
+    {
+        printf("The precision report needs a fixedSeed to compare maps\n");
+        return;
+    }
+
+    uint32 len = dim.w * dim.h;
+    char filename[64];
+    snprintf(filename, sizeof filename, "precision_%u_%ux%u.bin", gSet.fixedSeed, dim.w, dim.h);
+    FILE* fp = nullptr;
+
+#ifndef PW6_FLOAT32
+    fopen_s(&fp, filename, "wb");
+    if (fp)
+    {
+        fwrite(plotTypes, sizeof *plotTypes, len, fp);
+        fwrite(terrainTypes, sizeof *terrainTypes, len, fp);
+        fclose(fp);
+        printf("Saved the float64 reference to %s\n", filename);
+    }
+#else
+    fopen_s(&fp, filename, "rb");
+    if (!fp)
+    {
+        printf("No float64 reference at %s, run a float64 build with the same settings first\n", filename);
+        return;
+    }
+
+    uint8* refPlots = (uint8*)PoolAlloc(len * 2);
+    uint8* refTerrain = refPlots + len;
+    bool complete = fread(refPlots, 1, len * 2, fp) == len * 2;
+    fclose(fp);
+
+    if (complete)
+    {
+        uint32 plotDiffs = 0;
+        uint32 terrainDiffs = 0;
+        uint32 tileDiffs = 0;
+        for (uint32 i = 0; i < len; ++i)
+        {
+            bool plotDiff = plotTypes[i] != refPlots[i];
+            bool terrainDiff = terrainTypes[i] != refTerrain[i];
+            plotDiffs += plotDiff;
+            terrainDiffs += terrainDiff;
+            tileDiffs += plotDiff || terrainDiff;
+        }
+
+        printf("Precision report against float64:\n");
+        printf("   plot types differ on %.2f%% of tiles\n", plotDiffs * 100.0 / len);
+        printf("   terrain types differ on %.2f%% of tiles\n", terrainDiffs * 100.0 / len);
+        printf("   either differs on %.2f%% of tiles\n", tileDiffs * 100.0 / len);
+    }
+    else
+        printf("The float64 reference at %s doesn't match this map size\n", filename);
+
+    PoolFree(refPlots);
+#endif
+}
+
 // the "main()" of the alg
 void GenerateMap()
 {
@@ -3262,13 +5812,26 @@ void GenerateMap()
     };
 
     InitImageWriter(dim.w, dim.h, gSet.wrapX, gSet.wrapY, hexOffsets);
-
-    uint8* plotTypes = (uint8*)calloc(len, sizeof *plotTypes);
-    uint8* terrainTypes = (uint8*)calloc(len, sizeof *terrainTypes);
+    InitPerlinKernels(gSet.simdLevel);
+    InitWorkerPool();
+    if (gSet.gradientReport)
+        ReportPerlinGradient(dim);
+    for (uint32 i = 0; i < 4; ++i)
+        InitHexTopology(gHex + i, dim, i & 2, i & 1);
+    InitLatitudeModel(&gLat, dim.h);
+    // large enough for the oasis spacing and the biggest meteor
+    InitHexStencils(std::max<uint32>(3, dim.w / 16));
+
+    // start from a clean slate when generating more than one map
+    memset(gMap, 0, len * sizeof *gMap);
+
+    uint8* plotTypes = (uint8*)PoolCalloc(len, sizeof *plotTypes);
+    uint8* terrainTypes = (uint8*)PoolCalloc(len, sizeof *terrainTypes);
     ElevationMap map;
     FloatMap rainMap;
     FloatMap tempMap;
     PangaeaBreaker pb;
+    uint32 attemptMark = GetPoolMark();
 
     uint32 iter = 0;
 
@@ -3294,6 +5857,8 @@ void GenerateMap()
         ExitFloatMap(&tempMap);
         ExitFloatMap(&rainMap);
         ExitFloatMap(&map.base);
+        // anything else the attempt left behind
+        RewindGenPool(attemptMark);
     }
 
     gThrs.coast = map.seaThreshold;
@@ -3306,6 +5871,11 @@ void GenerateMap()
     if (iter == 10)
     {
         printf("Failed to break up Pangea!\n");
+        for (uint32 i = 0; i < 4; ++i)
+            ExitHexTopology(gHex + i);
+        ExitLatitudeModel(&gLat);
+        ExitHexStencils();
+        ResetGenPool();
         return;
     }
 
@@ -3313,6 +5883,9 @@ void GenerateMap()
 
     ApplyTerrain(len, plotTypes, terrainTypes);
 
+    if (gSet.precisionReport)
+        ReportPrecision(dim, plotTypes, terrainTypes);
+
     // TODO:
     //AreaBuilder.Recalculate()
     //TerrainBuilder.AnalyzeChokepoints()
@@ -3354,10 +5927,6 @@ void GenerateMap()
     //local biggest_area = Areas.FindBiggestArea(false);
     //print("Biggest area size = ", biggest_area:GetPlotCount());
 
-    // making this global for later use
-    gThrs.zeroTrees = FindThresholdFromPercent(&rainMap, gSet.zeroTreesPercent, true);
-    gThrs.jungle = FindThresholdFromPercent(&rainMap, gSet.junglePercent, true);
-
     //local nwGen = NaturalWonderGenerator.Create({
     //    numberToPlace = GameInfo.Maps[Map.GetMapSize()].NumNaturalWonders + mc.naturalWonderExtra,
     //});
@@ -3415,7 +5984,12 @@ void GenerateMap()
 
     SaveToCiv6Map("ItsAMap", &details, gMap);
 
+    for (uint32 i = 0; i < 4; ++i)
+        ExitHexTopology(gHex + i);
+    ExitLatitudeModel(&gLat);
+    ExitHexStencils();
     ExitImageWriter();
+    ResetGenPool();
 }
 
 
@@ -3423,84 +5997,106 @@ void GenerateMap()
 
 void GenerateTwistedPerlinMap(Dim dim, bool xWrap, bool yWrap,
     float64 minFreq, float64 maxFreq, float64 varFreq,
-    FloatMap* out)
+    NoiseSource const* inputNoise, FloatMap* out)
 {
-    FloatMap inputNoise;
-    InitFloatMap(&inputNoise, dim, xWrap, yWrap);
-    GenerateNoise(&inputNoise);
-    Normalize(&inputNoise);
-    DrawHexes(inputNoise.data, sizeof *inputNoise.data, PaintUnitFloatGradient);
-    SaveMap("00_initNoise.bmp");
-
     FloatMap freqMap;
     InitFloatMap(&freqMap, dim, xWrap, yWrap);
 
-    float64* ins = freqMap.data;
-    Coord c;
     uint16 w = dim.w;
     float64 h = dim.h * YtoXRatio;
-    for (c.y = 0; c.y < dim.h; ++c.y)
+    PerlinPlan plan;
+    InitPerlinPlan(&plan, inputNoise, w, h, varFreq, 8);
+
+    // min and max are order independent, so merging the
+    // chunks as they finish is still deterministic
+    std::mutex rangeMutex;
+    Range freqMapRange;
+    InitRange(&freqMapRange);
+
+    ParallelFor(dim.h, [&](uint32 begin, uint32 end)
     {
-        uint16 odd = c.y % 2;
+        PerlinRowScratch scratch;
+        InitPerlinRowScratch(&scratch, dim.w);
+        Range range;
+        InitRange(&range);
 
-        for (c.x = 0; c.x < dim.w; ++c.x, ++ins)
+        MapFloat* ins = freqMap.data + begin * dim.w;
+        for (uint32 y = begin; y < end; ++y, ins += dim.w)
         {
-            float64 x = c.x + odd * 0.5;
-            *ins = GetPerlinNoise(x, c.y * YtoXRatio, w, h, varFreq, 1.0, 0.1, 8, &inputNoise);
+            uint16 odd = y % 2;
+            GetPerlinNoiseRow(odd * 0.5, y * YtoXRatio, dim.w, 1.0, 0.1, &plan, &scratch, ins);
+            TrackRange(&range, ins, dim.w);
         }
-    }
-    Normalize(&freqMap);
-    DrawHexes(freqMap.data, sizeof *freqMap.data, PaintUnitFloatGradient);
-    SaveMap("01_freqNoise.bmp");
+
+        ExitPerlinRowScratch(&scratch);
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        MergeRange(&freqMapRange, range);
+    });
+    NormalizeRange(&freqMap, freqMapRange);
+    SaveFloatMap(&freqMap, "01_freqNoise.bmp");
 
     FloatMap* twistMap = out;
     InitFloatMap(twistMap, dim, xWrap, yWrap);
 
-    ins = twistMap->data;
-    float64* fIt = freqMap.data;
     float64 freqRange = (maxFreq - minFreq);
     float64 mid = freqRange / 2.0 + minFreq;
     float64 invMid = 1.0 / mid;
-    for (c.y = 0; c.y < dim.h; ++c.y)
+    InitPerlinPlan(&plan, inputNoise, w, h, mid, 8);
+    Range twistRange;
+    InitRange(&twistRange);
+
+    ParallelFor(dim.h, [&](uint32 begin, uint32 end)
     {
-        uint16 odd = c.y % 2;
+        PerlinRowScratch scratch;
+        InitPerlinRowScratch(&scratch, dim.w);
+        Range range;
+        InitRange(&range);
 
-        for (c.x = 0; c.x < dim.w; ++c.x, ++ins, ++fIt)
+        MapFloat* ins = twistMap->data + begin * dim.w;
+        MapFloat* fIt = freqMap.data + begin * dim.w;
+        for (uint32 y = begin; y < end; ++y, ins += dim.w)
         {
-            float64 freq = *fIt * freqRange + minFreq;
-            float64 coordScale = freq * invMid;
-            float64 offset = (1.0 - coordScale) * invMid;
-            float64 ampChange = 0.85 - *fIt * 0.5;
+            uint16 odd = y % 2;
 
-            float64 x = c.x + odd * 0.5;
-            *ins = GetPerlinNoise(x + offset, (c.y + offset) * YtoXRatio, w, h, mid, 1.0, ampChange, 8, &inputNoise);
+            // every tile samples its own offset, so gather them as a batch
+            for (uint32 x = 0; x < dim.w; ++x, ++fIt)
+            {
+                float64 freq = *fIt * freqRange + minFreq;
+                float64 coordScale = freq * invMid;
+                float64 offset = (1.0 - coordScale) * invMid;
+
+                float64 fx = x + odd * 0.5;
+                scratch.sampleX[x] = fx + offset;
+                scratch.sampleY[x] = (y + offset) * YtoXRatio;
+                scratch.sampleAmpChange[x] = 0.85 - *fIt * 0.5;
+            }
+            GetPerlinNoiseBatch(dim.w, 1.0, &plan, &scratch, ins);
+            TrackRange(&range, ins, dim.w);
         }
-    }
-    Normalize(twistMap);
-    DrawHexes(twistMap->data, sizeof *twistMap->data, PaintUnitFloatGradient);
-    SaveMap("02_twistNoise.bmp");
+
+        ExitPerlinRowScratch(&scratch);
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        MergeRange(&twistRange, range);
+    });
+    NormalizeRange(twistMap, twistRange);
+    SaveFloatMap(twistMap, "02_twistNoise.bmp");
 
     ExitFloatMap(&freqMap);
-    ExitFloatMap(&inputNoise);
 }
 
-void GenerateMountainMap(Dim dim, bool xWrap, bool yWrap, float64 initFreq,
-    FloatMap* out)
-{
-    FloatMap inputNoise;
-    InitFloatMap(&inputNoise, dim, xWrap, yWrap);
-    GenerateBinaryNoise(&inputNoise);
-    Normalize(&inputNoise);
-    DrawHexes(inputNoise.data, sizeof *inputNoise.data, PaintUnitFloatGradient);
-    SaveMap("03_inputNoise.bmp");
-
-    FloatMap inputNoise2;
-    InitFloatMap(&inputNoise2, dim, xWrap, yWrap);
-    GenerateBinaryNoise(&inputNoise2);
-    Normalize(&inputNoise2);
-    DrawHexes(inputNoise2.data, sizeof *inputNoise2.data, PaintUnitFloatGradient);
-    SaveMap("04_input2Noise.bmp");
+// GetAttenuationFactor of every tile as a map expression
+auto Attenuation(Dim dim)
+{
+    return Indexed([dim](uint32 i)
+    {
+        Coord c = { (uint16)(i % dim.w), (uint16)(i / dim.w) };
+        return GetAttenuationFactor(dim, c);
+    });
+}
 
+void GenerateMountainMap(Dim dim, bool xWrap, bool yWrap, float64 initFreq,
+    NoiseSource const* inputNoise, NoiseSource const* inputNoise2, FloatMap* out)
+{
     FloatMap* mountainMap = out;
     InitFloatMap(mountainMap, dim, xWrap, yWrap);
     FloatMap stdDevMap;
@@ -3508,101 +6104,89 @@ void GenerateMountainMap(Dim dim, bool xWrap, bool yWrap, float64 initFreq,
     FloatMap noiseMap;
     InitFloatMap(&noiseMap, dim, xWrap, yWrap);
 
-    float64* mtnIns = mountainMap->data;
-    Coord c;
     uint16 w = dim.w;
     float64 h = dim.h * YtoXRatio;
-    // init mountain map
-    for (c.y = 0; c.y < dim.h; ++c.y)
-    {
-        uint16 odd = c.y % 2;
-        for (c.x = 0; c.x < dim.w; ++c.x, ++mtnIns)
-        {
-            float64 x = c.x + odd * 0.5;
-            *mtnIns = GetPerlinNoise(x, c.y * YtoXRatio, w, h, initFreq, 1.0, 0.4, 8, &inputNoise);
-        }
-    }
-    // mirror data
-    memcpy(stdDevMap.data, mountainMap->data, dim.w * dim.h * sizeof float64);
-    // init noise map
-    float64* noiIns = noiseMap.data;
-    for (c.y = 0; c.y < dim.h; ++c.y)
-    {
-        uint16 odd = c.y % 2;
-        for (c.x = 0; c.x < dim.w; ++c.x, ++noiIns)
+    // both inputs share the octave setup, so they are sampled together
+    PerlinPlan plan;
+    InitPerlinPlan(&plan, inputNoise, w, h, initFreq, 8);
+    NoiseSource const* sources[2] = { inputNoise, inputNoise2 };
+
+    // init mountain map and noise map
+    // min and max are order independent, so merging the
+    // chunks as they finish is still deterministic
+    std::mutex rangeMutex;
+    Range mtnRange;
+    InitRange(&mtnRange);
+    Range noiRange;
+    InitRange(&noiRange);
+
+    ParallelFor(dim.h, [&](uint32 begin, uint32 end)
+    {
+        PerlinRowScratch scratch;
+        InitPerlinRowScratch(&scratch, dim.w);
+        Range mRange;
+        InitRange(&mRange);
+        Range nRange;
+        InitRange(&nRange);
+
+        MapFloat* mtnIns = mountainMap->data + begin * dim.w;
+        MapFloat* noiIns = noiseMap.data + begin * dim.w;
+        for (uint32 y = begin; y < end; ++y, mtnIns += dim.w, noiIns += dim.w)
         {
-            float64 x = c.x + odd * 0.5;
-            *noiIns = GetPerlinNoise(x, c.y * YtoXRatio, w, h, initFreq, 1.0, 0.4, 8, &inputNoise2);
+            uint16 odd = y % 2;
+            MapFloat* outs[2] = { mtnIns, noiIns };
+            GetPerlinNoiseRows(odd * 0.5, y * YtoXRatio, dim.w, 1.0, 0.4, &plan, sources, 2, &scratch, outs);
+            TrackRange(&mRange, mtnIns, dim.w);
+            TrackRange(&nRange, noiIns, dim.w);
         }
-    }
-
-    Normalize(mountainMap);
-    Deviate(&stdDevMap, 7);
-    Normalize(&stdDevMap);
-    Normalize(&noiseMap);
-    DrawHexes(mountainMap->data, sizeof *mountainMap->data, PaintUnitFloatGradient);
-    SaveMap("05_mtnNoise.bmp");
-    DrawHexes(stdDevMap.data, sizeof *stdDevMap.data, PaintUnitFloatGradient);
-    SaveMap("06_stdevNoise.bmp");
-    DrawHexes(noiseMap.data, sizeof *noiseMap.data, PaintUnitFloatGradient);
-    SaveMap("07_noiseNoise.bmp");
 
+        ExitPerlinRowScratch(&scratch);
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        MergeRange(&mtnRange, mRange);
+        MergeRange(&noiRange, nRange);
+    });
+    // mirror data
+    memcpy(stdDevMap.data, mountainMap->data, dim.w * dim.h * sizeof *stdDevMap.data);
+
+    NormalizeRange(mountainMap, mtnRange);
+    Range sdvRange = Deviate(&stdDevMap, 7);
+    NormalizeRange(&stdDevMap, sdvRange);
+    NormalizeRange(&noiseMap, noiRange);
+    SaveFloatMap(mountainMap, "05_mtnNoise.bmp");
+    SaveFloatMap(&stdDevMap, "06_stdevNoise.bmp");
+    SaveFloatMap(&noiseMap, "07_noiseNoise.bmp");
+
+    // the mountains are replaced by their mounds from here on, so the
+    // ridges are only found as the mounds are read for the final combine
     FloatMap moundMap;
     InitFloatMap(&moundMap, dim, xWrap, yWrap);
-    float64* mtnIt = mountainMap->data;
-    float64* mndIns = moundMap.data;
-    for (c.y = 0; c.y < dim.h; ++c.y)
+    auto mound = Transform(Read(mountainMap), [](float64 val)
     {
-        for (c.x = 0; c.x < dim.w; ++c.x, ++mtnIt, ++mndIns)
-        {
-            float64 val = *mtnIt;
-            *mndIns = (sin(val * M_PI * 2 - M_PI_2) * 0.5 + 0.5) * GetAttenuationFactor(dim, c);
-            //if (val < 0.5)
-            //    val = val * 4;
-            //else
-            //    val = (1 - val) * 4;
-            //*mtnIt = val;
-            *mtnIt = *mndIns;
-        }
-    }
-
-    Normalize(mountainMap);
+        return sin(val * M_PI * 2 - M_PI_2) * 0.5 + 0.5;
+    }) * Attenuation(dim);
+    Range mndRange = AssignRange(&moundMap, mound);
 
-    mtnIt = mountainMap->data;
-    for (c.y = 0; c.y < dim.h; ++c.y)
+    // normalized as it's read
+    auto ridges = Transform(Scaled(Read(&moundMap), GetRangeScale(mndRange)), [](float64 val)
     {
-        for (c.x = 0; c.x < dim.w; ++c.x, ++mtnIt)
-        {
-            float64 val = *mtnIt;
-            float64 p1 = sin(val * 3 * M_PI + M_PI_2);
-            float64 p2 = p1 * p1;
-            float64 p4 = p2 * p2;
-            float64 p8 = p4 * p4;
-            float64 p16 = p8 * p8;
-            float64 res = sqrt(p16 * val);
-
-            *mtnIt = res > 0.2 ? 1.0 : 0.0;
-        }
-    }
+        float64 p1 = sin(val * 3 * M_PI + M_PI_2);
+        float64 p2 = p1 * p1;
+        float64 p4 = p2 * p2;
+        float64 p8 = p4 * p4;
+        float64 p16 = p8 * p8;
+        float64 res = sqrt(p16 * val);
+
+        return res > 0.2 ? 1.0 : 0.0;
+    });
 
     float64 stdDevThreshold = FindThresholdFromPercent(&stdDevMap, 1.0 - gSet.landPercent, false);
     float64 dblThres = 2.0 * stdDevThreshold;
 
-    mtnIt = mountainMap->data;
-    float64* mndIt = moundMap.data;
-    float64* sdvIt = stdDevMap.data;
-    for (c.y = 0; c.y < dim.h; ++c.y)
-    {
-        for (c.x = 0; c.x < dim.w; ++c.x, ++mtnIt, ++mndIt, ++sdvIt)
-        {
-            float64 dev = 2.0 * *sdvIt - dblThres;
-            *mtnIt = (*mtnIt + *mndIt) * dev;
-        }
-    }
+    auto dev = 2.0 * Read(&stdDevMap) - dblThres;
+    mtnRange = AssignRange(mountainMap, (ridges + Read(&moundMap)) * dev);
 
-    Normalize(mountainMap);
-    DrawHexes(mountainMap->data, sizeof *mountainMap->data, PaintUnitFloatGradient);
-    SaveMap("08_mtn2Noise.bmp");
+    NormalizeRange(mountainMap, mtnRange);
+    SaveFloatMap(mountainMap, "08_mtn2Noise.bmp");
 }
 
 float64 GetAttenuationFactor(Dim dim, Coord c)
@@ -3645,35 +6229,98 @@ void GenerateElevationMap(Dim dim, bool xWrap, bool yWrap, ElevationMap * out)
     float64 twistVar = scale * gSet.twistVar;         // 0.042/128
     float64 mountainFreq = scale * gSet.mountainFreq; // 0.05 /128
 
+    // rand isn't thread safe and is per thread on some platforms, so all
+    // of the noise is generated here first in the same order as before
+    NoiseSource twistSource;
+    NoiseSource mountainSource;
+    NoiseSource mountainSource2;
+    FloatMap twistNoise;
+    FloatMap mountainNoise;
+    FloatMap mountainNoise2;
+    if (gSet.hashedNoise)
+    {
+        // each source only needs a seed
+        uint32 seed = ((uint32)rand() << 16) ^ (uint32)rand();
+        InitHashedNoiseSource(&twistSource, dim, xWrap, yWrap, false, seed);
+        seed = ((uint32)rand() << 16) ^ (uint32)rand();
+        InitHashedNoiseSource(&mountainSource, dim, xWrap, yWrap, true, seed);
+        seed = ((uint32)rand() << 16) ^ (uint32)rand();
+        InitHashedNoiseSource(&mountainSource2, dim, xWrap, yWrap, true, seed);
+    }
+    else
+    {
+        InitFloatMap(&twistNoise, dim, xWrap, yWrap);
+        NormalizeRange(&twistNoise, GenerateNoise(&twistNoise));
+        SaveFloatMap(&twistNoise, "00_initNoise.bmp");
+        InitMapNoiseSource(&twistSource, &twistNoise);
+        if (gSet.cubicCoefficients)
+            InitNoiseCoefficients(&twistSource);
+
+        InitFloatMap(&mountainNoise, dim, xWrap, yWrap);
+        NormalizeRange(&mountainNoise, GenerateBinaryNoise(&mountainNoise));
+        SaveFloatMap(&mountainNoise, "03_inputNoise.bmp");
+        InitMapNoiseSource(&mountainSource, &mountainNoise);
+        if (gSet.cubicCoefficients)
+            InitNoiseCoefficients(&mountainSource);
+
+        InitFloatMap(&mountainNoise2, dim, xWrap, yWrap);
+        NormalizeRange(&mountainNoise2, GenerateBinaryNoise(&mountainNoise2));
+        SaveFloatMap(&mountainNoise2, "04_input2Noise.bmp");
+        InitMapNoiseSource(&mountainSource2, &mountainNoise2);
+        if (gSet.cubicCoefficients)
+            InitNoiseCoefficients(&mountainSource2);
+    }
+
+    // the two maps are independent of each other and split the workers
     FloatMap twistMap;
-    GenerateTwistedPerlinMap(dim, xWrap, yWrap, twistMinFreq, twistMaxFreq, twistVar, &twistMap);
     FloatMap mountainMap;
-    GenerateMountainMap(dim, xWrap, yWrap, mountainFreq, &mountainMap);
+    uint32 workers = GetWorkerCount();
+    if (workers > 1)
+    {
+        uint32 twistWorkers = workers / 2;
+        std::thread twistThread([&]
+        {
+            SetWorkerBudget(twistWorkers);
+            GenerateTwistedPerlinMap(dim, xWrap, yWrap, twistMinFreq, twistMaxFreq, twistVar, &twistSource, &twistMap);
+        });
+
+        uint32 budget = SetWorkerBudget(workers - twistWorkers);
+        GenerateMountainMap(dim, xWrap, yWrap, mountainFreq, &mountainSource, &mountainSource2, &mountainMap);
+        SetWorkerBudget(budget);
+        twistThread.join();
+    }
+    else
+    {
+        GenerateTwistedPerlinMap(dim, xWrap, yWrap, twistMinFreq, twistMaxFreq, twistVar, &twistSource, &twistMap);
+        GenerateMountainMap(dim, xWrap, yWrap, mountainFreq, &mountainSource, &mountainSource2, &mountainMap);
+    }
+
+    ExitNoiseSource(&mountainSource2);
+    ExitNoiseSource(&mountainSource);
+    ExitNoiseSource(&twistSource);
+    if (!gSet.hashedNoise)
+    {
+        ExitFloatMap(&mountainNoise2);
+        ExitFloatMap(&mountainNoise);
+        ExitFloatMap(&twistNoise);
+    }
+
     ElevationMap* elevationMap = out;
     InitElevationMap(elevationMap, dim, xWrap, yWrap);
 
-    float64* it = twistMap.data;
-    float64* end = it + twistMap.length;
-    float64* mIt = mountainMap.data;
-    float64* eIt = elevationMap->base.data;
-
-    for (; it < end; ++it, ++mIt, ++eIt)
+    auto twist = Transform(Read(&twistMap), [](float64 tVal)
     {
-        float64 tVal = *it;
         //this formula adds a curve flattening the extremes
         tVal = sin(tVal * M_PI - M_PI_2) * 0.5 + 0.5;
-        tVal = sqrt(sqrt(tVal));
-        *eIt = tVal + ((*mIt * 2) - 1) * gSet.mountainWeight;
-    }
-
-    Normalize(&elevationMap->base);
+        return sqrt(sqrt(tVal));
+    });
+    Range elevRange = AssignRange(&elevationMap->base,
+        twist + ((Read(&mountainMap) * 2) - 1) * gSet.mountainWeight);
 
+    // normalized along with the attenuation
     // attentuation should not break normalization
-    eIt = elevationMap->base.data;
-    Coord c;
-    for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++eIt)
-            *eIt *= GetAttenuationFactor(dim, c);
+    Assign(&elevationMap->base,
+        Scaled(Read(&elevationMap->base), GetRangeScale(elevRange)) * Attenuation(dim));
 
     elevationMap->seaThreshold = FindThresholdFromPercent(&elevationMap->base, 1.0 - gSet.landPercent, false);
 
@@ -3709,10 +6356,13 @@ void GenerateTempMaps(ElevationMap* map, FloatMap* outSummer, FloatMap* outWinte
 
     FloatMap aboveSeaLevelMap;
     InitFloatMap(&aboveSeaLevelMap, dim, map->base.wrapX, map->base.wrapY);
-    float64* it = aboveSeaLevelMap.data;
-    float64* eIt = map->base.data;
+    MapFloat* it = aboveSeaLevelMap.data;
+    MapFloat* eIt = map->base.data;
     //float64* end = it + aboveSeaLevelMap.length;
 
+    Range range;
+    InitRange(&range);
+
     for (c.y = 0; c.y < dim.h; ++c.y)
         for (c.x = 0; c.x < dim.w; ++c.x, ++it, ++eIt)
         {
@@ -3720,9 +6370,10 @@ void GenerateTempMaps(ElevationMap* map, FloatMap* outSummer, FloatMap* outWinte
                 *it = 0.0;
             else
                 *it = *eIt - map->seaThreshold;
+            TrackRange(&range, *it);
         }
 
-    Normalize(&aboveSeaLevelMap);
+    NormalizeRange(&aboveSeaLevelMap, range);
 
     DrawHexes(aboveSeaLevelMap.data, sizeof *aboveSeaLevelMap.data, PaintUnitFloatGradient);
     SaveMap("11_LandMap.bmp");
@@ -3734,10 +6385,11 @@ void GenerateTempMaps(ElevationMap* map, FloatMap* outSummer, FloatMap* outWinte
     float64 bottomTempLat = gSet.bottomLatitude;
     float64 latRange = topTempLat - bottomTempLat;
     it = summerMap->data;
+    LatitudeModel const* model = GetLatitudeModel(&map->base);
 
     for (c.y = 0; c.y < dim.h; ++c.y)
     {
-        float64 lat = GetLatitudeForY(summerMap, c.y);
+        float64 lat = model->rows[c.y].latitude;
         float64 latPercent = (lat - bottomTempLat) / latRange;
         float64 temp = sin(latPercent * M_PI * 2 - M_PI_2) * 0.5 + 0.5;
         float64 tempAlt = temp * gSet.maxWaterTemp + gSet.minWaterTemp;
@@ -3746,8 +6398,8 @@ void GenerateTempMaps(ElevationMap* map, FloatMap* outSummer, FloatMap* outWinte
             *it = IsBelowSeaLevel(map, c) ? tempAlt : temp;
     }
 
-    Smooth(summerMap, reducedWidth);
-    Normalize(summerMap);
+    range = Smooth(summerMap, reducedWidth);
+    NormalizeRange(summerMap, range);
 
     DrawHexes(summerMap->data, sizeof *summerMap->data, PaintUnitFloatGradient);
     SaveMap("12_SummerTempMap.bmp");
@@ -3762,95 +6414,62 @@ void GenerateTempMaps(ElevationMap* map, FloatMap* outSummer, FloatMap* outWinte
 
     for (c.y = 0; c.y < dim.h; ++c.y)
     {
-        float64 lat = GetLatitudeForY(winterMap, c.y);
+        float64 lat = model->rows[c.y].latitude;
         float64 latPercent = (lat - bottomTempLat) / latRange;
         float64 temp = sin(latPercent * M_PI * 2 - M_PI_2) * 0.5 + 0.5;
         float64 tempAlt = temp * gSet.maxWaterTemp + gSet.minWaterTemp;
 
         for (c.x = 0; c.x < dim.w; ++c.x, ++it)
-            *it = IsBelowSeaLevel(map, c) ? tempAlt : temp;
-    }
-
-    Smooth(winterMap, reducedWidth);
-    Normalize(winterMap);
-
-    DrawHexes(winterMap->data, sizeof *winterMap->data, PaintUnitFloatGradient);
-    SaveMap("13_WinterTempMap.bmp");
-
-    FloatMap* temperatureMap = outTemp;
-    InitFloatMap(temperatureMap, dim, map->base.wrapX, map->base.wrapY);
-    it = temperatureMap->data;
-    float64* end = it + map->base.length;
-    float64* sIt = summerMap->data;
-    float64* wIt = winterMap->data;
-    float64* aIt = aboveSeaLevelMap.data;
-
-    for (; it < end; ++it, ++sIt, ++wIt, ++aIt)
-        *it = (*wIt + *sIt) * (1.0 - *aIt);
-
-    Normalize(temperatureMap);
-    ExitFloatMap(&aboveSeaLevelMap);
-
-    DrawHexes(temperatureMap->data, sizeof *temperatureMap->data, PaintUnitFloatGradient);
-    SaveMap("14_TempMap.bmp");
-}
-
-void GenerateRainfallMap(ElevationMap* map, FloatMap* outRain, FloatMap* outTemp)
-{
-    Dim dim = map->base.dim;
-    Coord c;
-
-    FloatMap summerMap, winterMap;
-    FloatMap* temperatureMap = outTemp;
-    GenerateTempMaps(map, &summerMap, &winterMap, temperatureMap);
-
-    FloatMap geoMap;
-    InitFloatMap(&geoMap, dim, map->base.wrapX, map->base.wrapY);
-    float64* it = geoMap.data;
-
-    for (c.y = 0; c.y < dim.h; ++c.y)
-    {
-        float64 lat = GetLatitudeForY(&map->base, c.y);
-        float64 pressure = GetGeostrophicPressure(&map->base, lat);
-
-        for (c.x = 0; c.x < dim.w; ++c.x, ++it)
-            *it = pressure;
+            *it = IsBelowSeaLevel(map, c) ? tempAlt : temp;
     }
 
-    Normalize(&geoMap);
+    range = Smooth(winterMap, reducedWidth);
+    NormalizeRange(winterMap, range);
 
-    DrawHexes(geoMap.data, sizeof *geoMap.data, PaintUnitFloatGradient);
-    SaveMap("15_GeoMap.bmp");
+    DrawHexes(winterMap->data, sizeof *winterMap->data, PaintUnitFloatGradient);
+    SaveMap("13_WinterTempMap.bmp");
 
-    // Create sorted summer map
-    RefMap* sortedSummerMap = (RefMap*)malloc(map->base.length * sizeof(RefMap));
-    RefMap* sIns = sortedSummerMap;
-    float64* sIt = geoMap.data;
+    FloatMap* temperatureMap = outTemp;
+    InitFloatMap(temperatureMap, dim, map->base.wrapX, map->base.wrapY);
+    range = AssignRange(temperatureMap,
+        (Read(winterMap) + Read(summerMap)) * (1.0 - Read(&aboveSeaLevelMap)));
 
-    for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++sIns, ++sIt)
-            *sIns = { c, *sIt };
+    NormalizeRange(temperatureMap, range);
+    ExitFloatMap(&aboveSeaLevelMap);
 
-    std::sort(sortedSummerMap, sIns, [](RefMap& a, RefMap& b) { return a.val < b.val; });
+    DrawHexes(temperatureMap->data, sizeof *temperatureMap->data, PaintUnitFloatGradient);
+    SaveMap("14_TempMap.bmp");
+}
 
-    // Create sorted winter map
-    RefMap* sortedWinterMap = (RefMap*)malloc(map->base.length * sizeof(RefMap));
-    RefMap* wIns = sortedWinterMap;
-    float64* wIt = geoMap.data;
+// Zeroes the rain below sea level for proper percent threshold finding and
+// normalizes what is left
+void FinishRainSweep(ElevationMap* map, FloatMap* rainfallMap, char const* filename)
+{
+    MapFloat const* elev = map->base.data;
+    MapFloat const* rain = rainfallMap->data;
+    float64 seaThreshold = map->seaThreshold;
 
-    for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++wIns, ++wIt)
-            *wIns = { c, *wIt };
+    Range range = MapKernelRange(rainfallMap, [&](uint32 i)
+    {
+        return elev[i] < seaThreshold ? 0.0 : rain[i];
+    });
 
-    std::sort(sortedWinterMap, wIns, [](RefMap& a, RefMap& b) { return a.val < b.val; });
+    NormalizeRange(rainfallMap, range);
+    SaveFloatMap(rainfallMap, filename);
+}
 
-    RefMap* sortedGeoMap = (RefMap*)malloc(map->base.length * sizeof(RefMap));
-    RefMap* geoIns = sortedGeoMap;
+// Orders the tiles of each wind zone along its geostrophic wind, starting
+// each row on water. Returns the number of tiles written to out
+uint32 SortByGeostrophicWind(ElevationMap* map, uint32* out)
+{
+    Dim dim = map->base.dim;
+    uint32* geoIns = out;
+    LatitudeModel const* model = GetLatitudeModel(&map->base);
 
     for (uint32 w = wNPolar; w <= wSPolar; ++w)
     {
-        uint16 topY = GetYFromZone(&map->base, (WindZone)w, true);
-        uint16 bottomY = GetYFromZone(&map->base, (WindZone)w, false);
+        uint16 topY = model->zoneTop[w];
+        uint16 bottomY = model->zoneBottom[w];
 
         if (topY != UINT16_MAX || bottomY != UINT16_MAX)
         {
@@ -3915,187 +6534,537 @@ void GenerateRainfallMap(ElevationMap* map, FloatMap* outRain, FloatMap* outTemp
                     if (rx >= dim.w)
                         rx -= dim.w;
                     assert(rx >= 0 && rx < dim.w);
-                    Coord crd = { (uint16)rx, (uint16)y };
-                    uint32 i = GetIndex(&map->base, crd);
-                    *geoIns = { crd, geoMap.data[i] };
+                    *geoIns = GetIndex(&map->base, { (uint16)rx, (uint16)y });
                 }
             }
         }
     }
-    uint32 dbgGeoCnt = geoIns - sortedGeoMap;
-    assert(dbgGeoCnt <= map->base.length);
 
-    FloatMap rainfallSummerMap;
-    InitFloatMap(&rainfallSummerMap, dim, map->base.wrapX, map->base.wrapY);
-    FloatMap moistureMap;
+    uint32 count = geoIns - out;
+    assert(count <= map->base.length);
+    return count;
+}
+
+// One of the rainfall sweeps. Each has its own buffers, so they can run
+// side by side
+struct RainPass
+{
+    FloatMap* pressureMap;
+    FloatMap* rainfallMap;
+    char const* filename;
+    bool isGeostrophic;
+    uint32 workers;
+};
+
+// x^N by squaring, unrolled for each N
+template <uint32 N>
+inline float64 PowN(float64 x)
+{
+    return PowN<N / 2>(x * x) * (N % 2 ? x : 1.0);
+}
+
+template <>
+inline float64 PowN<0>(float64)
+{
+    return 1.0;
+}
+
+template <uint32 N>
+void UpLiftKernel(FloatMap* out, MapFloat const* pressure, MapFloat const* temp)
+{
+    MapKernel(out, [=](uint32 i)
+    {
+        return std::max(PowN<N>(pressure[i]), 1.0 - temp[i]);
+    });
+}
+
+// How strongly the air rises over each tile. Rain is dropped by the cost of
+// lifting moisture from one tile to the next, which only depends on these
+void GenerateUpLiftMap(FloatMap* pressureMap, FloatMap* temperatureMap, FloatMap* out)
+{
+    InitFloatMap(out, pressureMap->dim, pressureMap->wrapX, pressureMap->wrapY);
+    MapFloat const* pressure = pressureMap->data;
+    MapFloat const* temp = temperatureMap->data;
+    int32 exponent = gSet.upLiftExponent;
+
+    if (gSet.integerUpLift)
+    {
+        switch (exponent)
+        {
+        case 1: UpLiftKernel<1>(out, pressure, temp); return;
+        case 2: UpLiftKernel<2>(out, pressure, temp); return;
+        case 3: UpLiftKernel<3>(out, pressure, temp); return;
+        case 4: UpLiftKernel<4>(out, pressure, temp); return;
+        case 5: UpLiftKernel<5>(out, pressure, temp); return;
+        case 6: UpLiftKernel<6>(out, pressure, temp); return;
+        case 7: UpLiftKernel<7>(out, pressure, temp); return;
+        case 8: UpLiftKernel<8>(out, pressure, temp); return;
+        default: break;
+        }
+    }
+
+    MapKernel(out, [=](uint32 i)
+    {
+        return std::max(std::pow(pressure[i], exponent), 1.0 - temp[i]);
+    });
+}
+
+// Orders the tiles, sweeps the rain across them and normalizes it. The
+// monsoon sweeps visit the tiles by geostrophic pressure, which is shared
+// through the cache. Their pressure maps aren't needed past their sweep and
+// are released.
+void RunRainPass(ElevationMap* map, FloatMap* temperatureMap, FloatMap* geoMap,
+    TileOrderCache* orders, RainPass* pass)
+{
+    Dim dim = map->base.dim;
+    uint32* sorted = nullptr;
+    uint32 const* visits;
+    uint32 count = map->base.length;
+
+    if (pass->isGeostrophic)
+    {
+        sorted = (uint32*)PoolAlloc(map->base.length * sizeof(uint32));
+        count = SortByGeostrophicWind(map, sorted);
+        visits = sorted;
+    }
+    else
+        visits = GetTileOrder(orders, geoMap);
+
+    FloatMap upLiftMap, moistureMap;
+    GenerateUpLiftMap(pass->pressureMap, temperatureMap, &upLiftMap);
     InitFloatMap(&moistureMap, dim, map->base.wrapX, map->base.wrapY);
-    RefMap* sumIt = sortedSummerMap;
-    RefMap* sumEnd = sIns;
 
-    for (; sumIt < sumEnd; ++sumIt)
-        DistributeRain(sumIt->c, map, temperatureMap, &summerMap, &rainfallSummerMap, &moistureMap, false);
+    SweepRain(map, temperatureMap, pass->pressureMap, &upLiftMap, visits, count,
+        pass->rainfallMap, &moistureMap, pass->isGeostrophic, pass->workers);
+
+    ExitFloatMap(&moistureMap);
+    ExitFloatMap(&upLiftMap);
+    PoolFree(sorted);
+    if (!pass->isGeostrophic)
+        ExitFloatMap(pass->pressureMap);
+
+    FinishRainSweep(map, pass->rainfallMap, pass->filename);
+}
 
-    FloatMap rainfallWinterMap;
-    InitFloatMap(&rainfallWinterMap, dim, map->base.wrapX, map->base.wrapY);
-    FloatMap moistureMap2;
-    InitFloatMap(&moistureMap2, dim, map->base.wrapX, map->base.wrapY);
-    RefMap* winIt = sortedWinterMap;
-    RefMap* winEnd = wIns;
+void GenerateRainfallMap(ElevationMap* map, FloatMap* outRain, FloatMap* outTemp)
+{
+    Dim dim = map->base.dim;
+    Coord c;
 
-    for (; winIt < winEnd; ++winIt)
-        DistributeRain(winIt->c, map, temperatureMap, &winterMap, &rainfallWinterMap, &moistureMap2, false);
+    // Each pass drops its pressure map and adds its rain to the output once
+    // its sweep is done, so the next pass reuses the blocks. With
+    // parallelRain all three passes and their buffers are alive at once.
+    PoolScope scope, sweepScope;
+    if (gSet.memoryReport)
+        BeginPoolScope(&scope);
 
-    FloatMap rainfallGeostrophicMap;
-    InitFloatMap(&rainfallGeostrophicMap, dim, map->base.wrapX, map->base.wrapY);
-    FloatMap moistureMap3;
-    InitFloatMap(&moistureMap3, dim, map->base.wrapX, map->base.wrapY);
-    RefMap* geoIt = sortedGeoMap;
-    RefMap* geoEnd = geoIns;
+    FloatMap summerMap, winterMap;
+    FloatMap* temperatureMap = outTemp;
+    GenerateTempMaps(map, &summerMap, &winterMap, temperatureMap);
 
-    for (; geoIt < geoEnd; ++geoIt)
-        DistributeRain(geoIt->c, map, temperatureMap, &geoMap, &rainfallGeostrophicMap, &moistureMap3, true);
+    if (gSet.memoryReport)
+        BeginPoolScope(&sweepScope);
 
-    float64* rsIt = rainfallSummerMap.data;
-    float64* rwIt = rainfallWinterMap.data;
-    float64* rgIt = rainfallGeostrophicMap.data;
+    FloatMap geoMap;
+    InitFloatMap(&geoMap, dim, map->base.wrapX, map->base.wrapY);
+    MapFloat* it = geoMap.data;
+    Range range;
+    InitRange(&range);
+    LatitudeModel const* model = GetLatitudeModel(&map->base);
 
-    // zero below sea level for proper percent threshold finding
     for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++rsIt, ++rwIt, ++rgIt)
-            if (IsBelowSeaLevel(map, c))
-            {
-                *rsIt = 0.0;
-                *rwIt = 0.0;
-                *rgIt = 0.0;
-            }
+    {
+        float64 pressure = model->rows[c.y].pressure;
+
+        for (c.x = 0; c.x < dim.w; ++c.x, ++it)
+            *it = pressure;
+        TrackRange(&range, it[-1]);
+    }
 
-    Normalize(&rainfallSummerMap);
-    Normalize(&rainfallWinterMap);
-    Normalize(&rainfallGeostrophicMap);
+    NormalizeRange(&geoMap, range);
 
-    DrawHexes(rainfallSummerMap.data, sizeof *rainfallSummerMap.data, PaintUnitFloatGradient);
-    SaveMap("16_SummerRainMap.bmp");
-    DrawHexes(rainfallWinterMap.data, sizeof *rainfallWinterMap.data, PaintUnitFloatGradient);
-    SaveMap("17_WinterRainMap.bmp");
-    DrawHexes(rainfallGeostrophicMap.data, sizeof *rainfallGeostrophicMap.data, PaintUnitFloatGradient);
-    SaveMap("18_GeoRainMap.bmp");
+    DrawHexes(geoMap.data, sizeof *geoMap.data, PaintUnitFloatGradient);
+    SaveMap("15_GeoMap.bmp");
 
+    // Summer rain becomes the output everything else is added to
     FloatMap* rainfallMap = outRain;
+    FloatMap winterRainMap, geoRainMap;
     InitFloatMap(rainfallMap, dim, map->base.wrapX, map->base.wrapY);
-    float64* rIns = rainfallMap->data;
-    float64* rEnd = rIns + map->base.length;
-    rsIt = rainfallSummerMap.data;
-    rwIt = rainfallWinterMap.data;
-    rgIt = rainfallGeostrophicMap.data;
-    for (; rIns < rEnd; ++rIns, ++rsIt, ++rwIt, ++rgIt)
-        *rIns = *rsIt + *rwIt + (*rgIt * gSet.geostrophicFactor);
+    InitFloatMap(&winterRainMap, dim, map->base.wrapX, map->base.wrapY);
 
-    Normalize(rainfallMap);
+    TileOrderCache orders;
+    InitTileOrderCache(&orders);
 
-    DrawHexes(rainfallMap->data, sizeof *rainfallMap->data, PaintUnitFloatGradient);
-    SaveMap("19_RainMap.bmp");
+    uint32 workers = GetWorkerCount();
+    RainPass summer = { &summerMap, rainfallMap, "16_SummerRainMap.bmp", false, workers };
+    RainPass winter = { &winterMap, &winterRainMap, "17_WinterRainMap.bmp", false, workers };
+    // The geostrophic sweep chains along the rows, with a level for about
+    // every tile of a row, so it always runs serially
+    RainPass geo = { &geoMap, &geoRainMap, "18_GeoRainMap.bmp", true, 1 };
 
-    ExitFloatMap(&moistureMap3);
-    ExitFloatMap(&rainfallGeostrophicMap);
-    ExitFloatMap(&moistureMap2);
-    ExitFloatMap(&rainfallWinterMap);
-    ExitFloatMap(&moistureMap);
-    ExitFloatMap(&rainfallSummerMap);
-    free(sortedGeoMap);
-    free(sortedWinterMap);
-    free(sortedSummerMap);
+    if (gSet.parallelRain && workers > 1)
+    {
+        // the monsoon sweeps share what the geostrophic one leaves, and each
+        // pass keeps the kernels it runs to its own share as well
+        summer.workers = winter.workers = std::max(1u, (workers - 1) / 2);
+        InitFloatMap(&geoRainMap, dim, map->base.wrapX, map->base.wrapY);
+
+        auto runPass = [&](RainPass* pass)
+        {
+            SetWorkerBudget(pass->workers);
+            RunRainPass(map, temperatureMap, &geoMap, &orders, pass);
+        };
+
+        std::thread winterThread(runPass, &winter);
+        std::thread geoThread(runPass, &geo);
+        uint32 budget = SetWorkerBudget(summer.workers);
+        RunRainPass(map, temperatureMap, &geoMap, &orders, &summer);
+        SetWorkerBudget(budget);
+        winterThread.join();
+        geoThread.join();
+
+        Assign(rainfallMap, Read(rainfallMap) + Read(&winterRainMap));
+        ExitFloatMap(&winterRainMap);
+    }
+    else
+    {
+        RunRainPass(map, temperatureMap, &geoMap, &orders, &summer);
+        RunRainPass(map, temperatureMap, &geoMap, &orders, &winter);
+
+        Assign(rainfallMap, Read(rainfallMap) + Read(&winterRainMap));
+        ExitFloatMap(&winterRainMap);
+
+        InitFloatMap(&geoRainMap, dim, map->base.wrapX, map->base.wrapY);
+        RunRainPass(map, temperatureMap, &geoMap, &orders, &geo);
+    }
+
+    ExitTileOrderCache(&orders);
     ExitFloatMap(&geoMap);
-    ExitFloatMap(&winterMap);
-    ExitFloatMap(&summerMap);
-}
 
-void DistributeRain(Coord c, ElevationMap * map, FloatMap * temperatureMap, 
-    FloatMap * pressureMap, FloatMap* rainfallMap, FloatMap* moistureMap, bool isGeostrophic)
-{
-    uint32 i = GetIndex(&map->base, c);
-    float64 temp = temperatureMap->data[i];
-    float64 pressure = pressureMap->data[i];
+    range = AssignRange(rainfallMap,
+        Read(rainfallMap) + Read(&geoRainMap) * gSet.geostrophicFactor);
 
-    float64 upLiftSource = std::max(std::pow(pressure, gSet.upLiftExponent), 1.0 - temp);
+    ExitFloatMap(&geoRainMap);
+    size_t sweepPeak = gSet.memoryReport ? EndPoolScope(&sweepScope) : 0;
+    NormalizeRange(rainfallMap, range);
 
-    if (IsBelowSeaLevel(map, c))
-        moistureMap->data[i] = std::max(moistureMap->data[i], temp);
+    DrawHexes(rainfallMap->data, sizeof *rainfallMap->data, PaintUnitFloatGradient);
+    SaveMap("19_RainMap.bmp");
 
-    uint32 nList[6];
+    if (gSet.memoryReport)
+        printf("Rainfall maps: %zu KB peak, %zu KB in the sweeps (%.2f maps)\n",
+            EndPoolScope(&scope) / 1024, sweepPeak / 1024,
+            sweepPeak / (float64)(map->base.length * sizeof(MapFloat)));
+}
+
+// Picks the neighbors tile i passes its moisture on to. These only depend on
+// the pressure, so they are known before any rain has fallen. Returns 0 when
+// the tile keeps its moisture as rain instead
+uint32 GetRainTargets(ElevationMap* map, FloatMap* pressureMap, uint32 i,
+    bool isGeostrophic, uint32 out[6])
+{
     uint32 ins = 0;
-    WindZone zone = GetZone(&map->base, c.y);
+    uint16 w = map->base.dim.w;
+    HexTopology const* topo = GetHexTopology(&map->base);
 
     if (isGeostrophic)
     {
-        std::pair<Dir, Dir> dir = GetGeostrophicWindDirections(zone);
-        Coord n;
-        GetNeighbor(&map->base, c, dir.first, &n);
-        uint32 ii = GetIndex(&map->base, n);
+        LatitudeRow const* rows = GetLatitudeModel(&map->base)->rows;
+        LatitudeRow const* row = rows + i / w;
+        uint32 ii = GetNeighborIndex(topo, i, row->wind);
 
-        if (ii < map->base.length && zone == GetZone(&map->base, n.y))
+        if (ii < map->base.length && row->zone == rows[ii / w].zone)
         {
-            nList[ins] = ii;
+            out[ins] = ii;
             ++ins;
         }
 
-        GetNeighbor(&map->base, c, dir.second, &n);
-        ii = GetIndex(&map->base, n);
+        ii = GetNeighborIndex(topo, i, row->lateralWind);
 
-        if (ii < map->base.length && zone == GetZone(&map->base, n.y))
+        if (ii < map->base.length && row->zone == rows[ii / w].zone)
         {
-            nList[ins] = ii;
+            out[ins] = ii;
             ++ins;
         }
     }
     else
     {
-        for (uint32 dir = dW; dir <= dSW; ++dir)
+        float64 pressure = pressureMap->data[i];
+        uint32 nbrs[6];
+        GetNeighborIndices(topo, i, nbrs);
+
+        for (uint32 n = 0; n < 6; ++n)
         {
-            Coord n;
-            GetNeighbor(&map->base, c, (Dir)dir, &n);
-            uint32 ii = GetIndex(&map->base, n);
+            uint32 ii = nbrs[n];
 
             if (ii < map->base.length && pressure <= pressureMap->data[ii])
             {
-                nList[ins] = ii;
+                out[ins] = ii;
                 ++ins;
             }
         }
     }
 
-    if (ins == 0 || (isGeostrophic && ins == 1))
+    if (isGeostrophic && ins == 1)
+        return 0;
+    return ins;
+}
+
+// Drops the rain of tile i holding moisture and writes the moisture passed
+// to each of its targets
+void DropRain(ElevationMap* map, FloatMap* upLiftMap, FloatMap* rainfallMap, uint32 i, MapFloat moisture, uint32 const* targets,
+    uint32 count, bool isGeostrophic, float64* passed)
+{
+    if (count == 0)
     {
-        rainfallMap->data[i] = moistureMap->data[i];
+        rainfallMap->data[i] = moisture;
         return;
     }
 
-    float64 moisturePerNeighbor = moistureMap->data[i] / ins;
+    float64 upLiftSource = upLiftMap->data[i];
+    float64 moisturePerNeighbor = moisture / count;
 
     // drop rain and pass moisture to neighbors
-    uint32* it = nList;
-    uint32* end = nList + ins;
     float64 bonus = 0.0;
+    WindZone zone = GetLatitudeModel(&map->base)->rows[i / map->base.dim.w].zone;
     if (zone == wNPolar || zone == wSPolar)
         bonus = gSet.polarRainBoost;
 
-    for (; it < end; ++it)
+    for (uint32 k = 0; k < count; ++k)
     {
-        float64 upLiftDest = std::max(std::pow(pressureMap->data[*it], gSet.upLiftExponent), 1.0 - temperatureMap->data[*it]);
-        float64 cost = GetRainCost(upLiftSource, upLiftDest);
+        uint32 ii = targets[k];
+        float64 cost = GetRainCost(upLiftSource, upLiftMap->data[ii]);
 
         if (isGeostrophic)
         {
-            if (it == nList)
-                moisturePerNeighbor = (1.0 - gSet.geostrophicLateralWindStrength) * moistureMap->data[i];
+            if (k == 0)
+                moisturePerNeighbor = (1.0 - gSet.geostrophicLateralWindStrength) * moisture;
             else
-                moisturePerNeighbor = gSet.geostrophicLateralWindStrength * moistureMap->data[i];
+                moisturePerNeighbor = gSet.geostrophicLateralWindStrength * moisture;
         }
 
         rainfallMap->data[i] += cost * moisturePerNeighbor + bonus;
 
         // pass to neighbor
-        moistureMap->data[*it] += moisturePerNeighbor - (cost * moisturePerNeighbor);
+        passed[k] = moisturePerNeighbor - (cost * moisturePerNeighbor);
+    }
+}
+
+void DistributeRain(uint32 i, ElevationMap * map, FloatMap * temperatureMap, 
+    FloatMap * pressureMap, FloatMap* upLiftMap, FloatMap* rainfallMap, FloatMap* moistureMap,
+    bool isGeostrophic)
+{
+    float64 temp = temperatureMap->data[i];
+
+    if (IsBelowSeaLevel(map, i))
+        moistureMap->data[i] = std::max<float64>(moistureMap->data[i], temp);
+
+    uint32 nList[6];
+    float64 passed[6];
+    uint32 ins = GetRainTargets(map, pressureMap, i, isGeostrophic, nList);
+    DropRain(map, upLiftMap, rainfallMap, i, moistureMap->data[i],
+        nList, ins, isGeostrophic, passed);
+
+    for (uint32 k = 0; k < ins; ++k)
+        moistureMap->data[nList[k]] += passed[k];
+}
+
+
+// --- Rain Sweeps
+
+// Monsoon sweeps have about one level per row, so sweeps over fewer tiles
+// than this have too few per level to be worth the synchronization between
+// levels and run on the calling thread
+#define RAIN_PARALLEL_MIN 32768
+
+// A rain sweep ordered by what actually depends on what. A visit only has to
+// wait for the earlier visits that pass moisture to its tile, and for the
+// previous visit of the tile itself. Visits are grouped into levels that
+// don't depend on each other, and every visit pulls the moisture sent to it
+// in the serial order, so the rain is identical to the serial sweep.
+struct RainSweep
+{
+    uint32 count;
+    // per visit, in the serial order
+    uint32* tiles;
+    uint8* targetCnt;
+    uint32* targets;
+    float64* passed;
+    // edges into each visit, as visit * 6 + target slot of the sender
+    uint32* inStart;
+    uint32* inEdges;
+
+    // visits grouped by level
+    uint32 levels;
+    uint32* order;
+    uint32* levelStart;
+};
+
+void InitRainSweep(RainSweep* sweep, ElevationMap* map, FloatMap* pressureMap,
+    uint32 const* visits, uint32 count, bool isGeostrophic)
+{
+    uint32 len = map->base.length;
+    sweep->count = count;
+    sweep->tiles = (uint32*)PoolAlloc(count * sizeof(uint32));
+    sweep->targetCnt = (uint8*)PoolAlloc(count * sizeof(uint8));
+    sweep->targets = (uint32*)PoolAlloc(count * 6 * sizeof(uint32));
+    sweep->passed = (float64*)PoolAlloc(count * 6 * sizeof(float64));
+    sweep->inStart = (uint32*)PoolAlloc((count + 1) * sizeof(uint32));
+    sweep->inEdges = (uint32*)PoolAlloc(count * 6 * sizeof(uint32));
+    sweep->order = (uint32*)PoolAlloc(count * sizeof(uint32));
+
+    // moisture sent to a tile waits in a queue until the tile is visited
+    uint32* head = (uint32*)PoolAlloc(len * sizeof(uint32));
+    uint32* tail = (uint32*)PoolAlloc(len * sizeof(uint32));
+    uint32* next = (uint32*)PoolAlloc(count * 6 * sizeof(uint32));
+    // deepest level that has touched each tile so far
+    uint32* tileLevel = (uint32*)PoolCalloc(len, sizeof(uint32));
+    uint32* level = (uint32*)PoolAlloc(count * sizeof(uint32));
+    memset(head, 0xFF, len * sizeof(uint32));
+
+    uint32 edges = 0;
+    sweep->levels = 0;
+
+    for (uint32 v = 0; v < count; ++v)
+    {
+        uint32 i = visits[v];
+        uint32* targets = sweep->targets + v * 6;
+        uint32 cnt = GetRainTargets(map, pressureMap, i, isGeostrophic, targets);
+        sweep->tiles[v] = i;
+        sweep->targetCnt[v] = (uint8)cnt;
+
+        sweep->inStart[v] = edges;
+        for (uint32 e = head[i]; e != UINT32_MAX; e = next[e])
+            sweep->inEdges[edges++] = e;
+        head[i] = UINT32_MAX;
+
+        level[v] = tileLevel[i];
+        tileLevel[i] = level[v] + 1;
+        sweep->levels = std::max(sweep->levels, level[v] + 1);
+
+        for (uint32 k = 0; k < cnt; ++k)
+        {
+            uint32 n = targets[k];
+            uint32 e = v * 6 + k;
+            next[e] = UINT32_MAX;
+            if (head[n] == UINT32_MAX)
+                head[n] = e;
+            else
+                next[tail[n]] = e;
+            tail[n] = e;
+
+            tileLevel[n] = std::max(tileLevel[n], level[v] + 1);
+        }
+    }
+    sweep->inStart[count] = edges;
+
+    // counting sort by level keeps the serial order within a level
+    sweep->levelStart = (uint32*)PoolCalloc(sweep->levels + 1, sizeof(uint32));
+    for (uint32 v = 0; v < count; ++v)
+        ++sweep->levelStart[level[v] + 1];
+    for (uint32 l = 0; l < sweep->levels; ++l)
+        sweep->levelStart[l + 1] += sweep->levelStart[l];
+
+    uint32* ins = tileLevel;
+    memcpy(ins, sweep->levelStart, sweep->levels * sizeof(uint32));
+    for (uint32 v = 0; v < count; ++v)
+        sweep->order[ins[level[v]]++] = v;
+
+    PoolFree(level);
+    PoolFree(tileLevel);
+    PoolFree(next);
+    PoolFree(tail);
+    PoolFree(head);
+}
+
+void ExitRainSweep(RainSweep* sweep)
+{
+    PoolFree(sweep->levelStart);
+    PoolFree(sweep->order);
+    PoolFree(sweep->inEdges);
+    PoolFree(sweep->inStart);
+    PoolFree(sweep->passed);
+    PoolFree(sweep->targets);
+    PoolFree(sweep->targetCnt);
+    PoolFree(sweep->tiles);
+}
+
+// Runs this worker's share of every level, waiting for the other workers
+// between levels
+void RunRainLevels(RainSweep* sweep, ElevationMap* map, FloatMap* temperatureMap,
+    FloatMap* upLiftMap, FloatMap* rainfallMap, FloatMap* moistureMap, bool isGeostrophic,
+    uint32 worker, uint32 workers, Barrier* barrier)
+{
+    for (uint32 l = 0; l < sweep->levels; ++l)
+    {
+        uint32 first = sweep->levelStart[l];
+        uint32 count = sweep->levelStart[l + 1] - first;
+        uint32 begin = first + (uint32)((uint64)count * worker / workers);
+        uint32 end = first + (uint32)((uint64)count * (worker + 1) / workers);
+
+        for (uint32 n = begin; n < end; ++n)
+        {
+            uint32 v = sweep->order[n];
+            uint32 i = sweep->tiles[v];
+            MapFloat* moisture = moistureMap->data + i;
+
+            for (uint32 e = sweep->inStart[v]; e < sweep->inStart[v + 1]; ++e)
+                *moisture += sweep->passed[sweep->inEdges[e]];
+
+            if (IsBelowSeaLevel(map, i))
+                *moisture = std::max<float64>(*moisture, temperatureMap->data[i]);
+
+            DropRain(map, upLiftMap, rainfallMap, i, *moisture,
+                sweep->targets + v * 6, sweep->targetCnt[v], isGeostrophic,
+                sweep->passed + v * 6);
+        }
+
+        if (barrier)
+            WaitBarrier(barrier);
+    }
+}
+
+void RunRainSweep(RainSweep* sweep, ElevationMap* map, FloatMap* temperatureMap,
+    FloatMap* upLiftMap, FloatMap* rainfallMap, FloatMap* moistureMap, bool isGeostrophic,
+    uint32 workers)
+{
+    if (workers <= 1)
+    {
+        RunRainLevels(sweep, map, temperatureMap, upLiftMap, rainfallMap, moistureMap,
+            isGeostrophic, 0, 1, nullptr);
+        return;
+    }
+
+    Barrier barrier;
+    InitBarrier(&barrier, workers);
+
+    auto part = [&](uint32 w)
+    {
+        RunRainLevels(sweep, map, temperatureMap, upLiftMap, rainfallMap, moistureMap,
+            isGeostrophic, w, workers, &barrier);
+    };
+    RunOnWorkers(workers, part);
+}
+
+// Calls DistributeRain for every visit in order, or runs the same sweep level
+// by level across the given number of workers
+void SweepRain(ElevationMap* map, FloatMap* temperatureMap, FloatMap* pressureMap,
+    FloatMap* upLiftMap, uint32 const* visits, uint32 count, FloatMap* rainfallMap,
+    FloatMap* moistureMap, bool isGeostrophic, uint32 workers)
+{
+    if (workers <= 1 || count < RAIN_PARALLEL_MIN)
+    {
+        for (uint32 v = 0; v < count; ++v)
+            DistributeRain(visits[v], map, temperatureMap, pressureMap, upLiftMap,
+                rainfallMap, moistureMap, isGeostrophic);
+        return;
     }
+
+    RainSweep sweep;
+    InitRainSweep(&sweep, map, pressureMap, visits, count, isGeostrophic);
+    RunRainSweep(&sweep, map, temperatureMap, upLiftMap, rainfallMap, moistureMap,
+        isGeostrophic, workers);
+    ExitRainSweep(&sweep);
 }
 
 float64 GetRainCost(float64 upLiftSource, float64 upLiftDest)
@@ -4119,44 +7088,28 @@ void PlacePossibleOasis(FloatMap * map, MapTile* plot, Coord c)
     {
         // too many oasis clustered together looks bad
         // reject if within 3 tiles of another oasis
-        Coord* coords;
-        uint32 len = GetRadiusAroundHex(map, c, 3, &coords);
-        Coord* it = coords;
-        Coord* end = it + len;
-        char const* name = "Hellow "   "World.";
-
-        for (; it < end; ++it)
+        bool valid = true;
+        ForEachInHex(map, c, 3, [&](uint32 ind)
         {
-            uint32 ind = (map->dim.w * it->y) + it->x;
             if (gMap[ind].feature == fOASIS)
-            {
-                free(coords);
-                return;
-            }
-        }
+                valid = false;
+        });
 
-        free(coords);
-
-        len = GetRadiusAroundHex(map, c, 1, &coords);
-        it = coords;
-        end = it + len;
+        if (!valid)
+            return;
 
-        for (; it < end; ++it)
+        ForEachInHex(map, c, 1, [&](uint32 ind)
         {
-            uint32 ind = (map->dim.w * it->y) + it->x;
             MapTile* nPlot = gMap + ind;
             if (nPlot->feature != fNONE ||
                 nPlot->terrain < tDESERT ||
                 // TODO: make mountain/hill testing smoother
                 (nPlot->terrain - tDESERT) % 5 != 0)
-            {
-                free(coords);
-                return;
-            }
-        }
+                valid = false;
+        });
 
-        free(coords);
-        plot->feature = fOASIS;
+        if (valid)
+            plot->feature = fOASIS;
     }
 }
 
@@ -4164,7 +7117,7 @@ void PlacePossibleIce(FloatMap* map, float64 temp, MapTile* plot, Coord c)
 {
     if (IsWater(plot))
     {
-        float64 latitude = GetLatitudeForY(map, c.y);
+        float64 latitude = GetLatitudeModel(map)->rows[c.y].latitude;
         float64 randvalNorth = PWRand() * (gSet.iceNorthLatitudeLimit - gSet.topLatitude) + gSet.topLatitude - 2;
         float64 randvalSouth = PWRand() * (gSet.bottomLatitude - gSet.iceSouthLatitudeLimit) + gSet.iceSouthLatitudeLimit;
 
@@ -4196,17 +7149,10 @@ void ApplyVolcanoBump(ElevationMap* map, uint32 i, Coord c)
     // this function adds a bump to volcano plots to guide the river system.
     map->base.data[i] *= 1.5;
 
-    Coord* list;
-    uint32 len = GetRadiusAroundHex(&map->base, c, 1, &list);
-    Coord* it = list;
-    Coord* end = it + len;
-
-    for (; it < end; ++it)
+    ForEachInHex(&map->base, c, 1, [&](uint32 ii)
     {
-        uint32 ii = GetIndex(&map->base, *it);
         map->base.data[ii] *= 1.25;
-    }
-    free(list);
+    });
 }
 
 void ApplyTerrain(uint32 len, uint8* plotTypes, uint8* terrainTypes)
@@ -4246,41 +7192,50 @@ uint32 GeneratePlotTypes(Dim dim, ElevationMap* outElev, FloatMap* outRain, Floa
     FloatMap diffMap;
     InitFloatMap(&diffMap, dim, true, false);
     Coord c;
-    float64* ins = diffMap.data;
+    MapFloat* ins = diffMap.data;
+    Range range;
+    InitRange(&range);
 
     for (c.y = 0; c.y < dim.h; ++c.y)
         for (c.x = 0; c.x < dim.w; ++c.x, ++ins)
+        {
             if (IsBelowSeaLevel(eMap, c))
                 *ins = 0.0;
             else
                 *ins = GetDifferenceAroundHex(eMap, c);
+            TrackRange(&range, *ins);
+        }
 
-    Normalize(&diffMap);
+    NormalizeRange(&diffMap, range);
 
     DrawHexes(diffMap.data, sizeof *diffMap.data, PaintUnitFloatGradient);
     SaveMap("20_DiffMap.bmp");
 
-    ins = diffMap.data;
-    float64* eIt = eMap->base.data;
+    MapFloat const* diff = diffMap.data;
+    MapFloat const* elev = eMap->base.data;
+    float64 seaThreshold = eMap->seaThreshold;
 
-    for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++ins, ++eIt)
-            if (!IsBelowSeaLevel(eMap, c))
-                *ins += *eIt * 1.1;
+    range = MapKernelRange(&diffMap, [&](uint32 i)
+    {
+        return elev[i] < seaThreshold ? diff[i] : diff[i] + elev[i] * 1.1;
+    });
 
-    Normalize(&diffMap);
+    NormalizeRange(&diffMap, range);
 
     DrawHexes(diffMap.data, sizeof *diffMap.data, PaintUnitFloatGradient);
     SaveMap("21_DiffMapBoost.bmp");
 
-    gThrs.hills = FindThresholdFromPercent(&diffMap, gSet.hillsPercent, true);
-    gThrs.mountains = FindThresholdFromPercent(&diffMap, gSet.mountainsPercent, true);
+    float64 const diffPercents[] = { gSet.hillsPercent, gSet.mountainsPercent };
+    float64 diffThresholds[2];
+    FindThresholdsFromPercents(&diffMap, diffPercents, 2, true, diffThresholds);
+    gThrs.hills = diffThresholds[0];
+    gThrs.mountains = diffThresholds[1];
 
     uint32_t len = dim.w * dim.h;
     // Note: allocating outside of function to reduce reallocs
     uint8* plotTypes = *outPlot;//(uint8*)malloc(sizeof * plotTypes * len);
     uint8* pIns = plotTypes;
-    float64* dIt = diffMap.data;
+    MapFloat* dIt = diffMap.data;
 
     for (c.y = 0; c.y < dim.h; ++c.y)
         for (c.x = 0; c.x < dim.w; ++c.x, ++pIns, ++dIt)
@@ -4301,9 +7256,9 @@ uint32 GenerateTerrain(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap,
 {
     Dim dim = map->base.dim;
     float64 minRain = 100.0;
-    float64* eIt = map->base.data;
-    float64* eEnd = eIt + map->base.length;
-    float64* rIt = rainMap->data;
+    MapFloat* eIt = map->base.data;
+    MapFloat* eEnd = eIt + map->base.length;
+    MapFloat* rIt = rainMap->data;
 
     // first find minimum rain above sea level for a soft desert transition
     for (; eIt < eEnd; ++eIt, ++rIt)
@@ -4311,13 +7266,24 @@ uint32 GenerateTerrain(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap,
             *rIt < minRain)
             minRain = *rIt;
 
-    // find exact thresholds, making these global for subsequent use
-    gThrs.desert = FindThresholdFromPercent(rainMap, gSet.desertPercent, true);
-    gThrs.plains = FindThresholdFromPercent(rainMap, gSet.plainsPercent, true);
+    // find exact thresholds, making these global for subsequent use. The
+    // rain map doesn't change after this, so the feature thresholds are
+    // found here too
+    float64 const rainPercents[] =
+    {
+        gSet.desertPercent, gSet.plainsPercent,
+        gSet.zeroTreesPercent, gSet.junglePercent,
+    };
+    float64 rainThresholds[4];
+    FindThresholdsFromPercents(rainMap, rainPercents, 4, true, rainThresholds);
+    gThrs.desert = rainThresholds[0];
+    gThrs.plains = rainThresholds[1];
+    gThrs.zeroTrees = rainThresholds[2];
+    gThrs.jungle = rainThresholds[3];
 
     eIt = map->base.data;
     rIt = rainMap->data;
-    float64* tIt = tempMap->data;
+    MapFloat* tIt = tempMap->data;
 
     uint32_t len = dim.w * dim.h;
     uint8* terrainTypes = *out;
@@ -4352,90 +7318,85 @@ uint32 GenerateTerrain(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap,
 
 void FinalAlterations(ElevationMap* map, uint8* plotTypes, uint8* terrainTypes)
 {
-    Dim dim = map->base.dim;
-    Coord c;
-    float64* eIt = map->base.data;
+    HexTopology const* topo = GetHexTopology(&map->base);
+    MapFloat* eIt = map->base.data;
     uint8* pIt = terrainTypes;
     uint8* tIt = terrainTypes;
+    uint32 nbrs[6];
 
     // now we fix things up so that the border of tundra and ice regions are hills
     // this looks a bit more believable. Also keep desert away from tundra and ice
     // by turning it into plains
-    for (c.y = 0; c.y < dim.h; ++c.y)
-        for (c.x = 0; c.x < dim.w; ++c.x, ++eIt, ++pIt, ++tIt)
-            if (*eIt >= map->seaThreshold)
+    for (uint32 idx = 0; idx < map->base.length; ++idx, ++eIt, ++pIt, ++tIt)
+        if (*eIt >= map->seaThreshold)
+        {
+            GetNeighborIndices(topo, idx, nbrs);
+
+            if (*tIt == tSNOW)
             {
-                if (*tIt == tSNOW)
+                bool lowerFound = false;
+
+                for (uint32 n = 0; n < 6; ++n)
                 {
-                    bool lowerFound = false;
+                    uint32 i = nbrs[n];
 
-                    for (uint32 dir = dW; dir < dNum; ++dir)
+                    if (i < map->base.length)
                     {
-                        Coord n;
-                        GetNeighbor(&map->base, c, (Dir)dir, &n);
-                        uint32 i = GetIndex(&map->base, n);
+                        uint8 t = terrainTypes[i];
 
-                        if (i < map->base.length)
-                        {
-                            uint8 t = terrainTypes[i];
-
-                            if (!IsBelowSeaLevel(map, i) &&
-                                t != tSNOW)
-                                lowerFound = true;
+                        if (!IsBelowSeaLevel(map, i) &&
+                            t != tSNOW)
+                            lowerFound = true;
 
-                            if (t == tDESERT)
-                                *tIt = tPLAINS;
-                        }
+                        if (t == tDESERT)
+                            *tIt = tPLAINS;
                     }
-
-                    if (lowerFound && *pIt == ptLand)
-                        *pIt = ptHills;
                 }
-                else if (*tIt == tTUNDRA)
+
+                if (lowerFound && *pIt == ptLand)
+                    *pIt = ptHills;
+            }
+            else if (*tIt == tTUNDRA)
+            {
+                bool lowerFound = false;
+
+                for (uint32 n = 0; n < 6; ++n)
                 {
-                    bool lowerFound = false;
+                    uint32 i = nbrs[n];
 
-                    for (uint32 dir = dW; dir < dNum; ++dir)
+                    if (i < map->base.length)
                     {
-                        Coord n;
-                        GetNeighbor(&map->base, c, (Dir)dir, &n);
-                        uint32 i = GetIndex(&map->base, n);
+                        uint8 t = terrainTypes[i];
 
-                        if (i < map->base.length)
-                        {
-                            uint8 t = terrainTypes[i];
-
-                            if (!IsBelowSeaLevel(map, i) &&
-                                t != tSNOW &&
-                                t != tTUNDRA)
-                                lowerFound = true;
+                        if (!IsBelowSeaLevel(map, i) &&
+                            t != tSNOW &&
+                            t != tTUNDRA)
+                            lowerFound = true;
 
-                            if (t == tDESERT)
-                                *tIt = tPLAINS;
-                        }
+                        if (t == tDESERT)
+                            *tIt = tPLAINS;
                     }
-
-                    if (lowerFound && *pIt == ptLand)
-                        *pIt = ptHills;
                 }
-                else if (*pIt == ptHills)
+
+                if (lowerFound && *pIt == ptLand)
+                    *pIt = ptHills;
+            }
+            else if (*pIt == ptHills)
+            {
+                for (uint32 n = 0; n < 6; ++n)
                 {
-                    for (uint32 dir = dW; dir < dNum; ++dir)
-                    {
-                        Coord n;
-                        GetNeighbor(&map->base, c, (Dir)dir, &n);
-                        uint32 i = GetIndex(&map->base, n);
+                    uint32 i = nbrs[n];
 
-                        if (i < map->base.length &&
-                            terrainTypes[i] == tSNOW ||
-                            terrainTypes[i] == tTUNDRA)
-                        {
-                            *pIt = ptLand;
-                            break;
-                        }
+                    if (i < map->base.length &&
+                        terrainTypes[i] == tSNOW ||
+                        terrainTypes[i] == tTUNDRA)
+                    {
+                        *pIt = ptLand;
+                        break;
                     }
                 }
             }
+        }
 }
 
 void GenerateCoasts(ElevationMap* map, uint8* plotTypes, uint8* terrainTypes)
@@ -4445,7 +7406,7 @@ void GenerateCoasts(ElevationMap* map, uint8* plotTypes, uint8* terrainTypes)
     Coord c;
     uint8* pIt = plotTypes;
     uint8* tIt = terrainTypes;
-    float64* eIt = map->base.data;
+    MapFloat* eIt = map->base.data;
     gThrs.coast = map->seaThreshold * 0.90;
 
     for (c.y = 0; c.y < dim.h; ++c.y)
@@ -4466,16 +7427,16 @@ void GenerateCoasts(ElevationMap* map, uint8* plotTypes, uint8* terrainTypes)
 void AddFeatures(ElevationMap* map, FloatMap* rainMap, FloatMap* tempMap)
 {
     Dim dim = map->base.dim;
-    float64 zeroTreesThreshold = FindThresholdFromPercent(rainMap, gSet.zeroTreesPercent, true);
-    float64 jungleThreshold = FindThresholdFromPercent(rainMap, gSet.junglePercent, true);
+    float64 zeroTreesThreshold = gThrs.zeroTrees;
+    float64 jungleThreshold = gThrs.jungle;
     float64 treeRange = jungleThreshold - zeroTreesThreshold;
     float64 marshRange = 1.0 - jungleThreshold;
 
     Coord c;
     MapTile* plot = gMap;
     MapTile* end = plot + map->base.length;
-    float64* rIt = rainMap->data;
-    float64* tIt = tempMap->data;
+    MapFloat* rIt = rainMap->data;
+    MapFloat* tIt = tempMap->data;
 
     for (; plot < end; ++plot, ++rIt, ++tIt)
         // avoid overwriting existing features
@@ -4552,7 +7513,7 @@ void AddRivers(RiverMap * map)
     River* end = river + map->riverCnt;
     RiverHex* riverHex;
     // TODO: set ref value on tile itself
-    uint8* checklist = (uint8*)calloc(map->eMap->base.length, sizeof uint8);
+    uint8* checklist = (uint8*)PoolCalloc(map->eMap->base.length, sizeof uint8);
 
     for (; river < end; ++river)
     {
@@ -4590,7 +7551,7 @@ void AddRivers(RiverMap * map)
             }
     }
 
-    free(checklist);
+    PoolFree(checklist);
 }
 
 void ClearFloodPlains(RiverMap* map)
@@ -4669,121 +7630,6 @@ void AddLakes(RiverMap* map)
             ins->terrain = tCOAST;
 }
 
-std::vector<uint32> GetRadiusAroundCell(Dim dim, Coord c, uint32 rad)
-{
-    std::vector<uint32> cellList;
-
-    for (uint32 r = 1; r <= rad; ++r)
-    {
-        // move here 1 West
-        GetNeighbor(NULL, c, dW, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-
-        for (uint32 i = 0; i < r; ++i)
-        {
-            GetNeighbor(NULL, c, dNE, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        for (uint32 i = 0; i < r; ++i)
-        {
-            GetNeighbor(NULL, c, dE, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        for (uint32 i = 0; i < r; ++i)
-        {
-            GetNeighbor(NULL, c, dSE, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        for (uint32 i = 0; i < r; ++i)
-        {
-            GetNeighbor(NULL, c, dSW, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        for (uint32 i = 0; i < r; ++i)
-        {
-            GetNeighbor(NULL, c, dW, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        for (uint32 i = 0; i < r - 1; ++i)
-        {
-            GetNeighbor(NULL, c, dNW, &c);
-            if (c.x < dim.w && c.y < dim.h)
-                cellList.push_back((uint32)c.y * dim.w + c.x);
-        }
-
-        GetNeighbor(NULL, c, dNW, &c);
-    }
-
-    return cellList;
-}
-
-std::vector<uint32> GetRingAroundCell(Dim dim, Coord c, uint32 rad)
-{
-    std::vector<uint32> cellList;
-
-    for (uint32 i = 0; i < rad; ++i)
-        GetNeighbor(NULL, c, dW, &c);
-
-    // TODO: remove, temporarily recreating bug in original program
-    if (c.x < dim.w && c.y < dim.h)
-        cellList.push_back((uint32)c.y * dim.w + c.x);
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dNE, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dE, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dSE, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dSW, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dW, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    for (uint32 i = 0; i < rad; ++i)
-    {
-        GetNeighbor(NULL, c, dNW, &c);
-        if (c.x < dim.w && c.y < dim.h)
-            cellList.push_back((uint32)c.y * dim.w + c.x);
-    }
-
-    return cellList;
-}
-
 
 // --- Generation Functions ---------------------------------------------------
 
@@ -4794,17 +7640,17 @@ void InitPangaeaBreaker(PangaeaBreaker * pb, ElevationMap* map, uint8* terrainTy
     pb->terrainTypes = terrainTypes;
     pb->oldWorldPercent = 1.0;
 
-    pb->distanceMap = (uint32*)calloc(map->base.length, sizeof(uint32));
+    pb->distanceMap = (uint32*)PoolCalloc(map->base.length, sizeof(uint32));
 
-    pb->newWorld = (bool*)calloc(map->base.length, sizeof(bool));
-    pb->newWorldMap = (bool*)calloc(map->base.length, sizeof(bool));
+    pb->newWorld = (bool*)PoolCalloc(map->base.length, sizeof(bool));
+    pb->newWorldMap = (bool*)PoolCalloc(map->base.length, sizeof(bool));
 }
 
 void ExitPangaeaBreaker(PangaeaBreaker* pb)
 {
-    free(pb->newWorldMap);
-    free(pb->newWorld);
-    free(pb->distanceMap);
+    PoolFree(pb->newWorldMap);
+    PoolFree(pb->newWorld);
+    PoolFree(pb->distanceMap);
     ExitPWAreaMap(&pb->areaMap);
 }
 
@@ -4915,7 +7761,6 @@ void CastMeteorUponTheEarth(PangaeaBreaker* pb, Coord c, uint8* plotTypes, uint8
 {
     Dim dim = pb->map->base.dim;
     uint32 radius = PWRandInt(minimumMeteorSize + 1, (uint32)floor(dim.w / 16.0f));
-    std::vector<uint32> ringList = GetRingAroundCell(dim, c, radius);
 
     printf("meteor damage radius = %d at %d, %d\n", radius, c.x, c.y);
 
@@ -4925,9 +7770,9 @@ void CastMeteorUponTheEarth(PangaeaBreaker* pb, Coord c, uint8* plotTypes, uint8
     plotTypes[i] = ptOcean;
     pb->map->base.data[i] = pb->map->seaThreshold - 0.01;
 
-    for (i = 0; i < ringList.size(); ++i)
+    i = 0;
+    ForEachOnRing(dim, c, radius, [&](uint32 ind)
     {
-        uint32 ind = ringList[i];
         if (terrainTypes[ind] != tOCEAN)
         {
             terrainTypes[ind] = tCOAST;
@@ -4935,17 +7780,15 @@ void CastMeteorUponTheEarth(PangaeaBreaker* pb, Coord c, uint8* plotTypes, uint8
         }
         plotTypes[ind] = ptOcean;
         pb->map->base.data[ind] = pb->map->seaThreshold - 0.01;
-    }
-
-    std::vector<uint32> innerList = GetRadiusAroundCell(dim, c, radius - 1);
+        ++i;
+    });
 
-    for (i = 0; i < innerList.size(); ++i)
+    ForEachAroundCell(dim, c, radius - 1, [&](uint32 ind)
     {
-        uint32 ind = innerList[i];
         terrainTypes[ind] = tOCEAN;
         plotTypes[ind] = ptOcean;
         pb->map->base.data[ind] = pb->map->seaThreshold - 0.01;
-    }
+    });
 }
 
 // UNUSED: void CreateDistanceMap(PangaeaBreaker* pb)
@@ -4969,7 +7812,7 @@ std::vector<CentralityScore> CreateContinentList(PangaeaBreaker* pb, uint32 id)
 
     printf("biggest ID = %d\n", id);
 
-    float64* aID = pb->areaMap.base.data;
+    MapFloat* aID = pb->areaMap.base.data;
     Coord c;
 
     for (c.y = 0; c.y < dim.h; ++c.y)
@@ -4986,10 +7829,11 @@ std::vector<CentralityScore> CreateContinentList(PangaeaBreaker* pb, uint32 id)
 
     for (CentralityScore& s : cs)
     {
-        std::vector<uint32> nList = GetRadiusAroundCell(dim, s.c, 1);
-        for (uint32 i : nList)
+        ForEachAroundCell(dim, s.c, 1, [&](uint32 i)
+        {
             if (pb->areaMap.base.data[i] == id)
                 s.neighborList.push_back(indexMap[i]);
+        });
     }
 
     return cs;
@@ -5141,7 +7985,7 @@ std::vector<uint32> GetLargeOldWorldPlots(PangaeaBreaker* pb)
     bool* it = pb->newWorld;
     bool* end = it + pb->map->base.length;
     MapTile* plot = gMap;
-    float64* id = pb->areaMap.base.data;
+    MapFloat* id = pb->areaMap.base.data;
     uint32 i = 0;
 
     std::vector<uint32> plots;
@@ -25,6 +25,14 @@ enum StartPosition
     spLegendary,
 };
 
+enum SimdLevel
+{
+    slAuto,   // Use the best instruction set the CPU supports
+    slScalar,
+    slSSE2,
+    slAVX2,
+};
+
 struct PW6Settings
 {
     /// General
@@ -200,6 +208,58 @@ struct PW6Settings
     // This is the minimum contiguous passable non water landmass that can be considered
     // a major civ capital. Full 3 radius city area could have 37 tiles maximum
     int32 realEstateMin = 15;
+
+
+
+    /// Performance
+
+    // Highest instruction set the noise kernels may use. Every level
+    // produces identical maps, this only exists to compare them
+    SimdLevel simdLevel = slAuto;
+    // Threads used by the parallel generation steps, 0 uses one per hardware
+    // thread and 1 runs everything serially. The maps are identical either way
+    uint32 workerThreads = 0;
+    // Builds with PW6_FLOAT32 defined store the maps in single precision.
+    // When set, float64 builds save their plot and terrain types for the
+    // fixedSeed and float32 builds report how many tiles differ from them
+    bool precisionReport = false;
+    // Prints how much of the generation pool the rainfall maps and their
+    // sweeps peak at, measured against the size of a single map
+    bool memoryReport = false;
+    // Checks the perlin gradient sampler against the noise it samples before
+    // generating and prints how far its slopes are from central differences
+    bool gradientReport = false;
+    // Hashes the elevation input noise from the seed on demand instead of
+    // filling noise maps with rand(). Faster and uses less memory, but
+    // produces different maps than older versions for the same seed
+    bool hashedNoise = false;
+    // Precomputes the cubic coefficients of the input noise maps once instead
+    // of per sample. The maps are identical, but it needs 4x the memory of the
+    // noise maps and only pays off on larger maps. Ignored with hashedNoise
+    bool cubicCoefficients = false;
+    // Runs the summer, winter and geostrophic rain sweeps at the same time.
+    // The maps are identical, but the rainfall buffers of all three sweeps
+    // are alive at once
+    bool parallelRain = false;
+    // Sorts the tiles the monsoon rain sweeps visit with a radix sort, which
+    // keeps tiles of equal pressure in map order. Faster, but produces
+    // different maps than older versions for the same seed
+    bool radixRainSort = false;
+    // Wraps tiles stepped off the west or south edge of a wrapping map onto
+    // the opposite edge. Older versions read them as column or row 65535
+    // and wrapped them from there, so this produces different maps than
+    // older versions for the same seed
+    bool signedEdgeWrap = false;
+    // Smooths the temperature maps and deviates the noise with sliding
+    // hex sums, which cost the same for any radius. Faster on larger maps,
+    // but rounds differently, so it produces different maps than older
+    // versions for the same seed
+    bool slidingHexSums = false;
+    // Raises the rain pressure to upLiftExponent with multiplications
+    // unrolled for exponents 1 through 8 instead of pow. Faster, but rounds
+    // differently, so it produces different maps than older versions for
+    // the same seed
+    bool integerUpLift = false;
 };
 
 struct Dim